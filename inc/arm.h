@@ -1,5 +1,19 @@
 #pragma once
 
+// Processor modes and CPSR bits
+#define PSR_MODE_MASK 0x1f
+#define PSR_MODE_USR 0x10
+#define PSR_MODE_FIQ 0x11
+#define PSR_MODE_IRQ 0x12
+#define PSR_MODE_SVC 0x13
+#define PSR_MODE_ABT 0x17
+#define PSR_MODE_UND 0x1b
+#define PSR_MODE_SYS 0x1f
+#define PSR_F 0x40		// FIQs masked
+#define PSR_I 0x80		// IRQs masked
+
+#ifndef __ASSEMBLER__
+
 static inline void wdacr(uint32_t value) {
 	asm volatile ("mcr p15, 0, %0, c3, c0, 0" : : "r"(value));
 }
@@ -24,4 +38,191 @@ static inline uint32_t rcr() {
 	uint32_t value;
 	asm volatile ("mrc p15, 0, %0, c1, c0, 0" : "=r"(value));
 	return value;
-}
\ No newline at end of file
+}
+
+// Performance monitor control register bits
+#define PMCR_E 0x1	// enable all counters
+#define PMCR_C 0x4	// reset the cycle counter
+#define PMCNTEN_C (1u << 31)	// cycle counter enable
+
+static inline void wpmcr(uint32_t value) {
+	asm volatile ("mcr p15, 0, %0, c9, c12, 0" : : "r"(value));
+}
+
+static inline void wpmcntenset(uint32_t value) {
+	asm volatile ("mcr p15, 0, %0, c9, c12, 1" : : "r"(value));
+}
+
+// read the cycle counter
+static inline uint32_t rpmccntr() {
+	uint32_t value;
+	asm volatile ("mrc p15, 0, %0, c9, c13, 0" : "=r"(value));
+	return value;
+}
+
+// coprocessor access; cp10 and cp11 are VFP and NEON
+#define CPACR_CP10_CP11 (0xf << 20)	// full access to both
+#define FPEXC_EN (1u << 30)
+
+static inline uint32_t rcpacr() {
+	uint32_t value;
+	asm volatile ("mrc p15, 0, %0, c1, c0, 2" : "=r"(value));
+	return value;
+}
+
+static inline void wcpacr(uint32_t value) {
+	asm volatile ("mcr p15, 0, %0, c1, c0, 2" : : "r"(value));
+}
+
+static inline void wfpexc(uint32_t value) {
+	asm volatile ("vmsr fpexc, %0" : : "r"(value));
+}
+
+// barriers
+static inline void dsb() {
+	asm volatile ("dsb" : : : "memory");
+}
+
+static inline void isb() {
+	asm volatile ("isb" : : : "memory");
+}
+
+// invalidate the unified TLB entry for an address
+static inline void tlbimva(uint32_t va) {
+	asm volatile ("mcr p15, 0, %0, c8, c7, 1" : : "r"(va) : "memory");
+}
+
+// invalidate the entire unified TLB
+static inline void tlbiall() {
+	asm volatile ("mcr p15, 0, %0, c8, c7, 0" : : "r"(0) : "memory");
+}
+
+// invalidate the unified TLB entries tagged with an ASID
+static inline void tlbiasid(uint32_t asid) {
+	asm volatile ("mcr p15, 0, %0, c8, c7, 2" : : "r"(asid) : "memory");
+}
+
+static inline void wcontextidr(uint32_t value) {
+	asm volatile ("mcr p15, 0, %0, c13, c0, 1" : : "r"(value));
+}
+
+// cache type, cache level ID, cache size ID and cache size selection
+static inline uint32_t rctr() {
+	uint32_t value;
+	asm volatile ("mrc p15, 0, %0, c0, c0, 1" : "=r"(value));
+	return value;
+}
+
+static inline uint32_t rclidr() {
+	uint32_t value;
+	asm volatile ("mrc p15, 1, %0, c0, c0, 1" : "=r"(value));
+	return value;
+}
+
+static inline uint32_t rccsidr() {
+	uint32_t value;
+	asm volatile ("mrc p15, 1, %0, c0, c0, 0" : "=r"(value));
+	return value;
+}
+
+static inline void wcsselr(uint32_t value) {
+	asm volatile ("mcr p15, 2, %0, c0, c0, 0" : : "r"(value));
+}
+
+// cache maintenance by address (to the point of coherency) and by
+// set/way
+static inline void dccmvac(uint32_t va) {
+	asm volatile ("mcr p15, 0, %0, c7, c10, 1" : : "r"(va) : "memory");
+}
+
+static inline void dcimvac(uint32_t va) {
+	asm volatile ("mcr p15, 0, %0, c7, c6, 1" : : "r"(va) : "memory");
+}
+
+static inline void dccimvac(uint32_t va) {
+	asm volatile ("mcr p15, 0, %0, c7, c14, 1" : : "r"(va) : "memory");
+}
+
+static inline void dccmvau(uint32_t va) {
+	asm volatile ("mcr p15, 0, %0, c7, c11, 1" : : "r"(va) : "memory");
+}
+
+static inline void dcisw(uint32_t setway) {
+	asm volatile ("mcr p15, 0, %0, c7, c6, 2" : : "r"(setway) : "memory");
+}
+
+static inline void dccisw(uint32_t setway) {
+	asm volatile ("mcr p15, 0, %0, c7, c14, 2" : : "r"(setway) : "memory");
+}
+
+static inline void icimvau(uint32_t va) {
+	asm volatile ("mcr p15, 0, %0, c7, c5, 1" : : "r"(va) : "memory");
+}
+
+// invalidate the whole instruction cache and the branch predictor
+static inline void iciallu() {
+	asm volatile ("mcr p15, 0, %0, c7, c5, 0" : : "r"(0) : "memory");
+}
+
+static inline void bpiall() {
+	asm volatile ("mcr p15, 0, %0, c7, c5, 6" : : "r"(0) : "memory");
+}
+
+// exception vector base address
+static inline void wvbar(uint32_t value) {
+	asm volatile ("mcr p15, 0, %0, c12, c0, 0" : : "r"(value));
+}
+
+// data fault status and address
+static inline uint32_t rdfsr() {
+	uint32_t value;
+	asm volatile ("mrc p15, 0, %0, c5, c0, 0" : "=r"(value));
+	return value;
+}
+
+static inline uint32_t rdfar() {
+	uint32_t value;
+	asm volatile ("mrc p15, 0, %0, c6, c0, 0" : "=r"(value));
+	return value;
+}
+
+// instruction fault status and address
+static inline uint32_t rifsr() {
+	uint32_t value;
+	asm volatile ("mrc p15, 0, %0, c5, c0, 1" : "=r"(value));
+	return value;
+}
+
+static inline uint32_t rifar() {
+	uint32_t value;
+	asm volatile ("mrc p15, 0, %0, c6, c0, 2" : "=r"(value));
+	return value;
+}
+
+// IRQ masking. irq_save masks IRQs and returns the CPSR to hand back
+// to irq_restore.
+static inline void enable_irq() {
+	asm volatile ("cpsie i" : : : "memory");
+}
+
+static inline void disable_irq() {
+	asm volatile ("cpsid i" : : : "memory");
+}
+
+static inline uint32_t irq_save() {
+	uint32_t cpsr;
+	asm volatile ("mrs %0, cpsr\n\tcpsid i" : "=r"(cpsr) : : "memory");
+	return cpsr;
+}
+
+static inline void irq_restore(uint32_t cpsr) {
+	asm volatile ("msr cpsr_c, %0" : : "r"(cpsr) : "memory");
+}
+
+// Wait for an interrupt. It wakes even with IRQs masked, so a caller
+// can check for work and sleep without a race.
+static inline void wfi() {
+	asm volatile ("wfi" : : : "memory");
+}
+
+#endif /* !__ASSEMBLER__ */
@@ -20,9 +20,9 @@
 #define KSTKSIZE	(128 * PGSIZE)   		// size of a kernel stack
 #define KSTKGAP		(128 * PGSIZE)   		// size of a kernel stack guard
 
-// Memory-mapped IO.
+// Memory-mapped IO, room for a few large device windows.
 #define MMIOLIM		(KSTACKTOP - PTSIZE)
-#define MMIOBASE	(MMIOLIM - PTSIZE)
+#define MMIOBASE	(MMIOLIM - 32 * PTSIZE)
 #define MCONSOLE    (MMIOBASE - PTSIZE)
 
 #define ULIM		(MCONSOLE)
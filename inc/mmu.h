@@ -45,9 +45,14 @@
 #define PTSIZE		(PGSIZE*NPTENTRIES) // bytes mapped by a page directory entry
 #define PTSHIFT		20		// log2(PTSIZE)
 
+#define LPGSIZE		(16*PGSIZE)	// bytes mapped by a large page
+#define SSECTSIZE	(16*PTSIZE)	// bytes mapped by a supersection
+
 #define PTXSHIFT	12		// offset of PTX in a linear address
 #define PDXSHIFT	20		// offset of PDX in a linear address
 
+#define CACHELINE	64		// bytes per L1 cache line (Cortex-A8)
+
 #define PDE_ADDR(pde)	((physaddr_t) (pde) & ~0x3FF)
 #define PTE_SMALL_ADDR(pte)   ((physaddr_t) (pte) & ~0xFFF)
 #define PTE_LARGE_ADDR(pte)   ((physaddr_t) (pte) & ~0xFFFF)
@@ -58,6 +63,8 @@
 #define PDE_NONE_U (1 << 10)
 #define PDE_R_U (2 << 10)
 #define PDE_RW_U (3 << 10)
+#define PDE_RO_NONE_U (PDE_APX | PDE_NONE_U)	// kernel read-only
+#define PDE_XN (1 << 4)		// never execute
 #define PDE_ENTRY_1M (0x2)
 #define PDE_ENTRY_16M ((0x2) | (1 << 18))
 #define PDE_ENTRY (0x1)
@@ -69,11 +76,64 @@
 #define PTE_NONE_U (1 << 4)
 #define PTE_R_U (2 << 4)
 #define PTE_RW_U (3 << 4)
+#define PTE_RO_NONE_U (PTE_APX | PTE_NONE_U)	// kernel read-only
+#define PTE_XN (1 << 0)		// never execute; bit 15 of a large page
 #define PTE_ENTRY_SMALL (0x2)
 #define PTE_ENTRY_LARGE (0x1)
+#define PTE_NG (1 << 11)	// not global: tagged with the ASID
+#define PTE_ATTR 0xffd		// every attribute bit of a small page
+#define PTE_AP_MASK (PTE_APX | PTE_RW_U)
+// Copy-on-write: read-only to everyone until a write fault copies the
+// page. APX with AP=10 is a deprecated alias of read-only (APX with
+// AP=11) that nothing else uses, so it is free to mark these.
+#define PTE_COW (PTE_APX | PTE_R_U)
 
 #define PTE_P (0x3)
 
+// Memory types, from the TEX, C and B bits. Page layout; sections keep
+// TEX at bit 12.
+#define PTE_B (1 << 2)
+#define PTE_C (1 << 3)
+#define PTE_TEX(x) ((x) << 6)
+#define PTE_MEM_MASK (PTE_TEX(7) | PTE_C | PTE_B)
+#define PTE_MEM_SO 0				// strongly ordered
+#define PTE_MEM_DEVICE PTE_B			// shareable device
+#define PTE_MEM_NC PTE_TEX(1)			// normal, uncached
+#define PTE_MEM_NORMAL (PTE_TEX(1) | PTE_C | PTE_B)	// normal, write-back
+							// write-allocate
+
+#define PDE_B (1 << 2)
+#define PDE_C (1 << 3)
+#define PDE_TEX(x) ((x) << 12)
+#define PDE_MEM_MASK (PDE_TEX(7) | PDE_C | PDE_B)
+#define PDE_MEM_SO 0
+#define PDE_MEM_DEVICE PDE_B
+#define PDE_MEM_NC PDE_TEX(1)
+#define PDE_MEM_NORMAL (PDE_TEX(1) | PDE_C | PDE_B)
+
+// Table walk attributes in TTBR0/1: walks look in the caches, outer
+// write-back write-allocate.
+#define TTBR_C 0x1
+#define TTBR_RGN_WBWA (1 << 3)
+#define TTBR_WALK (TTBR_C | TTBR_RGN_WBWA)
+
+// Fault status (DFSR/IFSR) fields
+#define FSR_FS(fsr) ((((fsr) >> 6) & 0x10) | ((fsr) & 0xf))
+#define FSR_WNR (1 << 11)	// DFSR: the access was a write
+#define FS_ALIGN 0x01
+#define FS_TRANS_SECT 0x05	// translation fault: nothing mapped
+#define FS_TRANS_PAGE 0x07
+#define FS_DOMAIN_SECT 0x09
+#define FS_DOMAIN_PAGE 0x0b
+#define FS_PERM_SECT 0x0d	// permission fault
+#define FS_PERM_PAGE 0x0f
+
+// System control register (SCTLR) flags
+#define SCTLR_M 0x1		// MMU
+#define SCTLR_C 0x4		// data and unified caches
+#define SCTLR_Z 0x800		// branch prediction
+#define SCTLR_I 0x1000		// instruction cache
+
 
 #define DOMAIN_NONE 0x0
 #define DOMAIN_CLIENT 0x1
@@ -0,0 +1,169 @@
+// Allocator statistics: calls and cycles per call site, cycle
+// histograms per operation and the free memory low-water mark are
+// collected when the kernel is built with ALLOC_STATS. The free run
+// distribution is computed on demand and is always available.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <kern/pmap.h>
+#include <kern/allocstat.h>
+
+#define NRUNBUCKETS 16		// free runs of 2^k regions, k < 16
+
+#ifdef ALLOC_STATS
+
+#define NSITES 64		// call sites tracked, a power of two
+#define NCYCBUCKETS 24		// [2^k, 2^(k+1)) cycles, the last open-ended
+
+struct site {
+	void *pc;		// return address into the caller
+	int op;
+	uint32_t calls;
+	uint32_t max;
+	uint64_t cycles;
+};
+
+struct opstat {
+	uint32_t calls;
+	uint64_t cycles;
+	uint32_t hist[NCYCBUCKETS];
+};
+
+static const char * const op_names[AS_NOPS] = {
+	"alloc", "free", "insert", "walk",
+};
+static struct site sites[NSITES];
+static uint32_t sites_dropped;	// calls from sites that didn't fit
+static struct opstat ops[AS_NOPS];
+static size_t low_water = ~(size_t)0;
+
+static inline int log2_bucket(uint32_t v, int nbuckets)
+{
+	return v ? MIN(31 - __builtin_clz(v), nbuckets - 1) : 0;
+}
+
+void allocstat_record(int op, void *pc, uint32_t cycles)
+{
+	struct opstat *o = &ops[op];
+	struct site *s;
+	uint32_t h;
+	int i;
+
+	o->calls++;
+	o->cycles += cycles;
+	o->hist[log2_bucket(cycles, NCYCBUCKETS)]++;
+
+	// open addressing on the return address
+	h = ((((uintptr_t)pc >> 2) ^ op) * 2654435761u) >> 26;
+	for (i = 0; i < NSITES; i++) {
+		s = &sites[(h + i) % NSITES];
+		if (s->pc == pc && s->op == op)
+			break;
+		if (s->pc == NULL) {
+			s->pc = pc;
+			s->op = op;
+			break;
+		}
+	}
+	if (i == NSITES) {
+		sites_dropped++;
+		return;
+	}
+	s->calls++;
+	s->cycles += cycles;
+	if (cycles > s->max)
+		s->max = cycles;
+}
+
+void allocstat_level(size_t nfree)
+{
+	if (nfree < low_water)
+		low_water = nfree;
+}
+
+static void print_counters(void)
+{
+	static bool shown[NSITES];
+	int i, j, op, best;
+
+	cprintf("free regions low-water mark: %u\n", low_water);
+
+	cprintf("%-7s %9s %10s %9s\n", "op", "calls", "cycles", "avg");
+	for (op = 0; op < AS_NOPS; op++) {
+		struct opstat *o = &ops[op];
+
+		cprintf("%-7s %9u %10llu %9u\n", op_names[op], o->calls,
+			o->cycles, o->calls ? (uint32_t)(o->cycles / o->calls) : 0);
+	}
+
+	cprintf("cycle histograms (calls taking at least N cycles):\n");
+	for (op = 0; op < AS_NOPS; op++) {
+		if (!ops[op].calls)
+			continue;
+		cprintf("  %s:", op_names[op]);
+		for (i = 0; i < NCYCBUCKETS; i++)
+			if (ops[op].hist[i])
+				cprintf(" %u:%u", 1u << i, ops[op].hist[i]);
+		cprintf("\n");
+	}
+
+	// busiest sites first
+	cprintf("%-8s %-7s %9s %9s %9s\n", "site", "op", "calls", "avg", "max");
+	memset(shown, 0, sizeof(shown));
+	for (;;) {
+		best = -1;
+		for (j = 0; j < NSITES; j++)
+			if (sites[j].pc && !shown[j] &&
+			    (best < 0 || sites[j].cycles > sites[best].cycles))
+				best = j;
+		if (best < 0)
+			break;
+		shown[best] = true;
+		cprintf("%08x %-7s %9u %9u %9u\n", sites[best].pc,
+			op_names[sites[best].op], sites[best].calls,
+			(uint32_t)(sites[best].cycles / sites[best].calls),
+			sites[best].max);
+	}
+	if (sites_dropped)
+		cprintf("(%u calls from untracked sites)\n", sites_dropped);
+}
+
+void allocstat_reset(void)
+{
+	memset(sites, 0, sizeof(sites));
+	memset(ops, 0, sizeof(ops));
+	sites_dropped = 0;
+	low_water = ~(size_t)0;
+}
+
+#else
+
+static void print_counters(void)
+{
+	cprintf("call counters disabled (build with ALLOC_STATS)\n");
+}
+
+void allocstat_reset(void)
+{
+}
+
+#endif
+
+void allocstat_print(void)
+{
+	uint32_t runs[NRUNBUCKETS];
+	size_t largest;
+	int i;
+
+	print_counters();
+
+	region_free_runs(runs, NRUNBUCKETS, &largest);
+	cprintf("free runs (regions: count):");
+	for (i = 0; i < NRUNBUCKETS; i++)
+		if (runs[i])
+			cprintf(" %u%s:%u", 1u << i,
+				i == NRUNBUCKETS - 1 ? "+" : "", runs[i]);
+	cprintf("\nlargest free run: %u regions (%uK)\n", largest,
+		largest * (MEM_UNIT / 1024));
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/arm.h>
+
+// Allocator operations counted when built with ALLOC_STATS.
+enum {
+	AS_ALLOC,	// region_alloc, region_alloc_order
+	AS_FREE,	// region_free, region_free_order, last region_decref
+	AS_INSERT,	// region_insert
+	AS_WALK,	// pgdir_walk
+	AS_NOPS
+};
+
+#ifdef ALLOC_STATS
+void allocstat_record(int op, void *site, uint32_t cycles);
+void allocstat_level(size_t nfree);
+
+// Time the rest of the enclosing function and charge it to the caller.
+#define ALLOCSTAT_BEGIN() uint32_t allocstat_t0 = rpmccntr()
+#define ALLOCSTAT_END(op) allocstat_record(op, __builtin_return_address(0), \
+					   rpmccntr() - allocstat_t0)
+// Note the number of free regions after an allocation.
+#define ALLOCSTAT_LEVEL(nfree) allocstat_level(nfree)
+#else
+#define ALLOCSTAT_BEGIN() do { } while (0)
+#define ALLOCSTAT_END(op) do { } while (0)
+#define ALLOCSTAT_LEVEL(nfree) do { } while (0)
+#endif
+
+void allocstat_print(void);
+void allocstat_reset(void);
@@ -0,0 +1,194 @@
+// Boot parameters: the bootloader passes the physical address of either
+// an ATAGS list or a flattened device tree in r2. Only the description
+// of memory is used.
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/string.h>
+#include <inc/arm.h>
+#include <kern/pmap.h>
+#include <kern/bootinfo.h>
+#include <kern/cache.h>
+
+#define ATAG_NONE 0x00000000
+#define ATAG_CORE 0x54410001
+#define ATAG_MEM 0x54410002
+
+struct atag {
+	uint32_t size;		// in words, header included
+	uint32_t tag;
+	union {
+		struct {
+			uint32_t size;
+			uint32_t start;
+		} mem;
+	};
+};
+
+#define FDT_MAGIC 0xd00dfeed
+#define FDT_BEGIN_NODE 0x1
+#define FDT_END_NODE 0x2
+#define FDT_PROP 0x3
+#define FDT_NOP 0x4
+#define FDT_END 0x9
+
+// All fields are big-endian.
+struct fdt_header {
+	uint32_t magic;
+	uint32_t totalsize;
+	uint32_t off_dt_struct;
+	uint32_t off_dt_strings;
+	uint32_t off_mem_rsvmap;
+	uint32_t version;
+	uint32_t last_comp_version;
+};
+
+#define MAX_BANKS 8
+static struct {
+	uint64_t start;
+	uint64_t end;
+} banks[MAX_BANKS];
+static int nbanks;
+
+static void add_bank(uint64_t start, uint64_t size)
+{
+	if (nbanks == MAX_BANKS || size == 0)
+		return;
+	banks[nbanks].start = start;
+	banks[nbanks].end = start + size;
+	nbanks++;
+}
+
+// The boot page table only maps the first 16MiB. Map the sections
+// holding [pa, pa + len) at KADDR(pa) so the parameters can be read in
+// place; mem_init rewrites these entries when it maps physical memory.
+static void *params_map(physaddr_t pa, size_t len)
+{
+	physaddr_t p;
+
+	if (pa >= DIRECTMAP_MAX || len > DIRECTMAP_MAX - pa)
+		return NULL;
+	for (p = ROUNDDOWN(pa, PTSIZE); p < pa + len; p += PTSIZE)
+		if (kern_pgdir[PDX(KADDR(p))] == 0) {
+			kern_pgdir[PDX(KADDR(p))] = p | PDE_ENTRY_1M |
+				PDE_NONE_U | PDE_MEM_NORMAL | PDE_XN;
+			pte_sync(&kern_pgdir[PDX(KADDR(p))], sizeof(pde_t));
+		}
+	dsb();
+	isb();
+	return (void *)KADDR(pa);
+}
+
+static bool parse_atags(physaddr_t pa)
+{
+	struct atag *t;
+
+	if (!(t = params_map(pa, sizeof(*t))) || t->tag != ATAG_CORE)
+		return false;
+	while (t->size >= 2 && t->tag != ATAG_NONE) {
+		if (t->tag == ATAG_MEM)
+			add_bank(t->mem.start, t->mem.size);
+		pa += t->size * 4;
+		if (!(t = params_map(pa, sizeof(*t))))
+			break;
+	}
+	return true;
+}
+
+static inline uint32_t be32(const uint32_t *p)
+{
+	return __builtin_bswap32(*p);
+}
+
+static uint64_t fdt_cells(const uint32_t **p, int n)
+{
+	uint64_t v = 0;
+
+	while (n-- > 0)
+		v = (v << 32) | be32((*p)++);
+	return v;
+}
+
+static bool parse_fdt(physaddr_t pa)
+{
+	struct fdt_header *h;
+	const uint32_t *p, *end;
+	const char *strings;
+	int depth = 0;
+	int acells = 2, scells = 1;	// defaults when the root doesn't say
+	bool memnode = false;
+
+	if (!(h = params_map(pa, sizeof(*h))) || be32(&h->magic) != FDT_MAGIC)
+		return false;
+	if (!params_map(pa, be32(&h->totalsize)))
+		return false;
+	p = (const uint32_t *)((char *)h + be32(&h->off_dt_struct));
+	end = (const uint32_t *)((char *)h + be32(&h->totalsize));
+	strings = (const char *)h + be32(&h->off_dt_strings);
+
+	while (p < end) {
+		switch (be32(p++)) {
+		case FDT_BEGIN_NODE: {
+			const char *name = (const char *)p;
+
+			depth++;
+			memnode = depth == 2 && (strcmp(name, "memory") == 0 ||
+						 strncmp(name, "memory@", 7) == 0);
+			p += strlen(name) / 4 + 1;
+			break;
+		}
+		case FDT_END_NODE:
+			depth--;
+			memnode = false;
+			break;
+		case FDT_PROP: {
+			uint32_t len = be32(p);
+			const char *name = strings + be32(p + 1);
+			const uint32_t *val = p + 2;
+
+			p += 2 + (len + 3) / 4;
+			if (depth == 1 && strcmp(name, "#address-cells") == 0)
+				acells = be32(val);
+			else if (depth == 1 && strcmp(name, "#size-cells") == 0)
+				scells = be32(val);
+			else if (memnode && strcmp(name, "reg") == 0) {
+				const uint32_t *vend = val + len / 4;
+				while (val + acells + scells <= vend) {
+					uint64_t start = fdt_cells(&val, acells);
+					add_bank(start, fdt_cells(&val, scells));
+				}
+			}
+			break;
+		}
+		case FDT_NOP:
+			break;
+		case FDT_END:
+			return true;
+		default:
+			return true;	// keep what was found so far
+		}
+	}
+	return true;
+}
+
+uint64_t bootinfo_memsize(physaddr_t params)
+{
+	uint64_t top = 0;
+	bool grown;
+	int i;
+
+	if (params % 4 != 0 || !(parse_atags(params) || parse_fdt(params)))
+		return 0;
+
+	// The kernel direct-maps RAM from physical address 0, so only the
+	// banks contiguous with it count.
+	do {
+		grown = false;
+		for (i = 0; i < nbanks; i++)
+			if (banks[i].start <= top && banks[i].end > top) {
+				top = banks[i].end;
+				grown = true;
+			}
+	} while (grown);
+	return top;
+}
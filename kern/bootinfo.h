@@ -0,0 +1,7 @@
+#pragma once
+#include <inc/types.h>
+
+// Size of the RAM starting at physical address 0, as described by the
+// ATAGS list or flattened device tree at 'params' (the r2 the bootloader
+// hands to _start). Returns 0 if 'params' holds neither.
+uint64_t bootinfo_memsize(physaddr_t params);
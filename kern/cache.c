@@ -0,0 +1,180 @@
+// Cache maintenance. entry.S turns on only the MMU; cache_init then
+// invalidates whatever the caches hold from before reset and turns on
+// the data and instruction caches and branch prediction. From then on
+// RAM is mapped normal write-back and devices are mapped device, see
+// PTE_MEM_*.
+//
+// The range operations work by virtual address, a cache line at a
+// time, to the point of coherency.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/arm.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
+#include <kern/cache.h>
+
+#define CLIDR_LOC(clidr) (((clidr) >> 24) & 0x7)
+#define CLIDR_CTYPE(clidr, level) (((clidr) >> (3 * (level))) & 0x7)
+#define CTYPE_DATA 0x2		// this level has a data or unified cache
+
+static void check_cache(void);
+
+// smallest line of any data and of any instruction cache
+static inline size_t dcache_line(void)
+{
+	return 4 << ((rctr() >> 16) & 0xf);
+}
+
+static inline size_t icache_line(void)
+{
+	return 4 << (rctr() & 0xf);
+}
+
+// Invalidate every data and unified cache up to the point of coherency
+// by set/way, dropping anything dirty. Only safe while they are off.
+static void dcache_inval_all(void)
+{
+	uint32_t clidr = rclidr();
+	uint32_t ccsidr, level, set, way, sets, ways, lshift, wshift;
+
+	for (level = 0; level < CLIDR_LOC(clidr); level++) {
+		if (CLIDR_CTYPE(clidr, level) < CTYPE_DATA)
+			continue;
+		wcsselr(level << 1);
+		isb();
+		ccsidr = rccsidr();
+		lshift = (ccsidr & 0x7) + 4;
+		ways = ((ccsidr >> 3) & 0x3ff) + 1;
+		sets = ((ccsidr >> 13) & 0x7fff) + 1;
+		wshift = ways > 1 ? __builtin_clz(ways - 1) : 0;
+		for (way = 0; way < ways; way++)
+			for (set = 0; set < sets; set++)
+				dcisw((way << wshift) | (set << lshift) |
+				      (level << 1));
+	}
+	dsb();
+}
+
+void cache_init(void)
+{
+	assert(!(rcr() & SCTLR_C));
+	dcache_inval_all();
+	iciallu();
+	bpiall();
+	dsb();
+	isb();
+	wcr(rcr() | SCTLR_C | SCTLR_I | SCTLR_Z);
+	isb();
+	check_cache();
+}
+
+// Write dirty lines in [va, va + size) back to memory.
+void dcache_clean_range(uintptr_t va, size_t size)
+{
+	size_t line = dcache_line();
+	uintptr_t end = va + size;
+
+	for (va = ROUNDDOWN(va, line); va < end; va += line)
+		dccmvac(va);
+	dsb();
+}
+
+// Discard the cached copies of [va, va + size), so the next reads come
+// from memory. Lines only partly in the range are written back first so
+// the bytes around it survive.
+void dcache_inval_range(uintptr_t va, size_t size)
+{
+	size_t line = dcache_line();
+	uintptr_t end = va + size;
+
+	if (va % line) {
+		dccimvac(ROUNDDOWN(va, line));
+		va = ROUNDUP(va, line);
+	}
+	if (end % line && va < end) {
+		dccimvac(ROUNDDOWN(end, line));
+		end = ROUNDDOWN(end, line);
+	}
+	for (; va < end; va += line)
+		dcimvac(va);
+	dsb();
+}
+
+// Write back and discard [va, va + size).
+void dcache_flush_range(uintptr_t va, size_t size)
+{
+	size_t line = dcache_line();
+	uintptr_t end = va + size;
+
+	for (va = ROUNDDOWN(va, line); va < end; va += line)
+		dccimvac(va);
+	dsb();
+}
+
+// Make instructions just written to [va, va + size) executable: clean
+// them to where the instruction side fetches from, then drop stale
+// instructions and branch predictions.
+void icache_sync_range(uintptr_t va, size_t size)
+{
+	size_t dline = dcache_line(), iline = icache_line();
+	uintptr_t end = va + size, p;
+
+	for (p = ROUNDDOWN(va, dline); p < end; p += dline)
+		dccmvau(p);
+	dsb();
+	for (p = ROUNDDOWN(va, iline); p < end; p += iline)
+		icimvau(p);
+	bpiall();
+	dsb();
+	isb();
+}
+
+void cache_print_info(void)
+{
+	uint32_t clidr = rclidr(), ccsidr, level;
+	uint32_t sctlr = rcr();
+
+	cprintf("dcache %s, icache %s, branch prediction %s\n",
+		sctlr & SCTLR_C ? "on" : "off", sctlr & SCTLR_I ? "on" : "off",
+		sctlr & SCTLR_Z ? "on" : "off");
+	for (level = 0; level < CLIDR_LOC(clidr); level++) {
+		if (CLIDR_CTYPE(clidr, level) < CTYPE_DATA)
+			continue;
+		wcsselr(level << 1);
+		isb();
+		ccsidr = rccsidr();
+		cprintf("L%d: %dK, %d-way, %d-byte lines\n", level + 1,
+			(((ccsidr >> 13) & 0x7fff) + 1) *
+			(((ccsidr >> 3) & 0x3ff) + 1) *
+			(16 << (ccsidr & 0x7)) / 1024,
+			((ccsidr >> 3) & 0x3ff) + 1, 16 << (ccsidr & 0x7));
+	}
+}
+
+static void
+check_cache(void)
+{
+	static uint8_t buf[4 * CACHELINE] __attribute__((aligned(CACHELINE)));
+	size_t i;
+
+	assert((rcr() & (SCTLR_C | SCTLR_I | SCTLR_Z)) ==
+	       (SCTLR_C | SCTLR_I | SCTLR_Z));
+	assert(dcache_line() >= 16);
+
+	// cleaning and flushing leave the data in place
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i;
+	dcache_clean_range((uintptr_t)buf + 3, sizeof(buf) - 3);
+	dcache_flush_range((uintptr_t)buf, sizeof(buf));
+	for (i = 0; i < sizeof(buf); i++)
+		assert(buf[i] == (uint8_t)i);
+
+	// invalidating a misaligned range keeps the bytes around it
+	memset(buf, 0xa5, sizeof(buf));
+	dcache_inval_range((uintptr_t)buf + 1, sizeof(buf) - 2);
+	assert(buf[0] == 0xa5 && buf[sizeof(buf) - 1] == 0xa5);
+
+	cprintf("check_cache() succeeded!\n");
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <inc/types.h>
+
+void cache_init(void);
+void dcache_clean_range(uintptr_t va, size_t size);
+void dcache_inval_range(uintptr_t va, size_t size);
+void dcache_flush_range(uintptr_t va, size_t size);
+void icache_sync_range(uintptr_t va, size_t size);
+void cache_print_info(void);
+
+// Make page table entries just written visible to the table walker,
+// which doesn't look in the L1 data cache.
+static inline void pte_sync(const void *p, size_t size)
+{
+	dcache_clean_range((uintptr_t)p, size);
+}
@@ -1,14 +1,53 @@
+// Console on the PL011 UART. Until console_init, output polls the
+// UART through the boot mapping. After it, output goes through a ring
+// the transmit interrupt drains, so console_write only waits when the
+// ring is full, and input is read into a ring by the receive
+// interrupts. getchar sleeps in wfi while there is nothing to read.
+//
+// Output goes to the FIFO in bursts: once the flag register says the
+// FIFO is empty, a FIFO's worth is written without looking again.
+
 #include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/arm.h>
 #include <kern/pmap.h>
+#include <kern/irq.h>
+#include <kern/klog.h>
+#include <kern/trace.h>
+#include <kern/console.h>
 #include <inc/config.h>
 
 struct uart {
 	uint32_t dr;
-	uint32_t whatever[5];
+	uint32_t rsr;
+	uint32_t reserved0[4];
 	uint32_t fr;
+	uint32_t reserved1[4];
+	uint32_t lcr_h;
+	uint32_t cr;
+	uint32_t ifls;		// FIFO levels that raise the interrupts
+	uint32_t imsc;		// interrupt mask, set bits enabled
+	uint32_t ris;
+	uint32_t mis;
+	uint32_t icr;
 };
 
-static struct uart *uart0 = (struct uart*)
+#define FR_RXFE 0x10		// receive FIFO empty
+#define FR_TXFF 0x20		// transmit FIFO full
+#define FR_TXFE 0x80		// transmit FIFO empty
+#define LCR_H_FEN 0x10		// FIFOs enabled
+#define CR_UARTEN 0x001
+#define CR_TXE 0x100
+#define CR_RXE 0x200
+#define IFLS_TX_1_8 0x0		// transmit when the FIFO drains to 1/8
+#define IFLS_RX_1_2 (0x2 << 3)	// receive when it fills to 1/2
+#define INT_RX 0x10
+#define INT_TX 0x20
+#define INT_RT 0x40		// receive timeout: data sat in the FIFO
+#define FIFO_DEPTH 16
+
+static volatile struct uart *uart0 = (struct uart*)
 (MCONSOLE +
 #ifdef VERSATILE_PB
 	0xF1000
@@ -17,13 +56,85 @@ static struct uart *uart0 = (struct uart*)
 #endif
 );
 
+// Rings indexed by free-running counters; sizes are powers of two.
+#define TXBUFSIZE 4096
+#define RXBUFSIZE 256
+static struct {
+	char buf[TXBUFSIZE];
+	uint32_t head, tail;	// producer and consumer counts
+} tx;
+static struct {
+	char buf[RXBUFSIZE];
+	uint32_t head, tail;
+} rx;
+
+static bool uart_irq;		// console_init has set up the interrupts
+
+// How many characters the transmit FIFO surely has room for: all of it
+// if it is empty, one if it isn't full.
+static inline int uart_tx_room(void)
+{
+	uint32_t fr = uart0->fr;
+
+	return fr & FR_TXFE ? FIFO_DEPTH : fr & FR_TXFF ? 0 : 1;
+}
+
+// Move what fits from the transmit ring into the FIFO, and leave the
+// transmit interrupt enabled only while there is more. IRQs must be
+// masked.
+static void uart_tx_pump(void)
+{
+	int n;
+
+	while (tx.tail != tx.head && (n = uart_tx_room()) > 0)
+		for (; n > 0 && tx.tail != tx.head; n--)
+			uart0->dr = tx.buf[tx.tail++ % TXBUFSIZE];
+	if (tx.tail != tx.head)
+		uart0->imsc |= INT_TX;
+	else
+		uart0->imsc &= ~INT_TX;
+}
+
+// Empty the receive FIFO into the ring, dropping what doesn't fit.
+static void uart_rx_pump(void)
+{
+	char c;
+
+	while (!(uart0->fr & FR_RXFE)) {
+		c = uart0->dr;
+		if (rx.head - rx.tail < RXBUFSIZE)
+			rx.buf[rx.head++ % RXBUFSIZE] = c;
+	}
+}
+
+static void uart_intr(void)
+{
+	uint32_t rx0 = rx.head;
+
+	uart_rx_pump();
+	TRACE(TR_CONSIRQ, tx.head - tx.tail, rx.head - rx0);
+	uart_tx_pump();
+	uart0->icr = INT_RX | INT_RT;
+}
+
 void console_init()
 {
+	uint32_t flags;
+
 #ifdef VERSATILE_PB
 	uart0 = (struct uart *)mmio_map_region(0x101F1000, 4 * 1024);
 #else
 	uart0 = (struct uart *)mmio_map_region(0x20201000, 4 * 1024);
 #endif
+	flags = irq_save();
+	uart0->lcr_h |= LCR_H_FEN;
+	uart0->cr |= CR_UARTEN | CR_TXE | CR_RXE;
+	uart0->ifls = IFLS_TX_1_8 | IFLS_RX_1_2;
+	uart0->icr = ~0u;
+	uart0->imsc = INT_RX | INT_RT;
+	irq_register(IRQ_UART0, uart_intr);
+	uart_irq = true;
+	irq_restore(flags);
 }
 
 int iscons(int fdnum)
@@ -31,16 +142,75 @@ int iscons(int fdnum)
 	return 1;
 }
 
+// Write len bytes to the console.
+void console_write(const char *buf, size_t len)
+{
+	uint32_t flags;
+	size_t n;
+
+	if (!uart_irq) {
+		// without FIFOs, "empty" only means room for one
+		size_t burst = uart0->lcr_h & LCR_H_FEN ? FIFO_DEPTH : 1;
+
+		while (len) {
+			while (!(uart0->fr & FR_TXFE))
+				continue;
+			for (n = MIN(len, burst); n > 0; n--, len--)
+				uart0->dr = *buf++;
+		}
+		return;
+	}
+
+	flags = irq_save();
+	TRACE(TR_CONSWRITE, len, tx.head - tx.tail);
+	while (len) {
+		// full: drain by hand, as IRQs may have been masked by our
+		// caller
+		while (tx.head - tx.tail == TXBUFSIZE)
+			uart_tx_pump();
+		n = MIN(len, TXBUFSIZE - (tx.head - tx.tail));
+		n = MIN(n, TXBUFSIZE - tx.head % TXBUFSIZE);
+		memcpy(&tx.buf[tx.head % TXBUFSIZE], buf, n);
+		tx.head += n;
+		buf += n;
+		len -= n;
+	}
+	uart_tx_pump();
+	irq_restore(flags);
+}
+
 void cputchar(int c)
 {
-	while (uart0->fr & 0x20)
-		continue;
-	uart0->dr = c;
+	char ch = c;
+
+	console_write(&ch, 1);
 }
 
 int getchar()
 {
-	while (uart0->fr & 0x10)
-		continue;
-	return uart0->dr;
+	uint32_t flags;
+	int c;
+
+	if (!uart_irq) {
+		while (uart0->fr & FR_RXFE)
+			continue;
+		return uart0->dr;
+	}
+
+	for (;;) {
+		// nothing else to do: let the log catch up
+		klog_drain();
+		flags = irq_save();
+		// serve the UART here too, in case our caller masked IRQs
+		uart_intr();
+		if (rx.tail != rx.head) {
+			c = rx.buf[rx.tail++ % RXBUFSIZE];
+			irq_restore(flags);
+			return c;
+		}
+		// idle until the next interrupt, which is taken (or served
+		// above) once IRQs are back as they were
+		wfi();
+		irq_restore(flags);
+	}
 }
@@ -1,3 +1,5 @@
 #pragma once
+#include <inc/types.h>
 
-void console_init();
\ No newline at end of file
+void console_init();
+void console_write(const char *buf, size_t len);
@@ -1,16 +1,48 @@
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/memlayout.h>
+#include <inc/arm.h>
 #include <kern/pmap.h>
+#include <kern/cache.h>
+#include <kern/slab.h>
+#include <kern/trap.h>
+#include <kern/irq.h>
+#include <kern/klog.h>
+#include <kern/trace.h>
+#include <kern/membench.h>
+#include <kern/allocstat.h>
 #include <kern/monitor.h>
 #include <kern/console.h>
 
 uint8_t bootstack[KSTKSIZE + KSTKGAP] __attribute__((aligned(PTSIZE)));
 
-void kern_init()
+void kern_init(physaddr_t bootparams)
 {
-	mem_init();
+	cache_init();
+	// start the cycle counter for the allocator statistics
+	wpmcr(PMCR_E | PMCR_C);
+	wpmcntenset(PMCNTEN_C);
+#ifdef USE_NEON
+	// zero_region stores with NEON
+	wcpacr(rcpacr() | CPACR_CP10_CP11);
+	isb();
+	wfpexc(FPEXC_EN);
+#endif
+	// everything from here on copies and clears through these
+	check_memfuncs();
+
+	mem_init(bootparams);
+	slab_init();
+	trap_init();
+	irq_init();
+	klog_init();
+	trace_init();
+	check_string();
+	// don't let the self-tests skew the statistics
+	allocstat_reset();
+	trap_reset_stats();
 	console_init();
+	enable_irq();
 	monitor(NULL);
 }
 
@@ -0,0 +1,102 @@
+// Interrupt controller: the PL190 VIC on the Versatile PB, or the
+// BCM2835 controller on the Raspberry Pi. Every line is routed to IRQ,
+// never FIQ, and trap() hands IRQs to irq_dispatch, which calls the
+// handler of each line pending.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/config.h>
+#include <kern/pmap.h>
+#include <kern/irq.h>
+#include <kern/klog.h>
+
+#ifdef VERSATILE_PB
+#define IC_BASE 0x10140000
+#define VIC_IRQSTATUS 0x000
+#define VIC_INTSELECT 0x00c
+#define VIC_INTENABLE 0x010
+#define VIC_INTENCLEAR 0x014
+#else
+#define IC_BASE 0x2000b000
+#define BCM_PENDING1 0x204
+#define BCM_PENDING2 0x208
+#define BCM_ENABLE1 0x210
+#define BCM_ENABLE2 0x214
+#define BCM_DISABLE1 0x21c
+#define BCM_DISABLE2 0x220
+#endif
+
+static volatile uint32_t *ic;
+static void (*handlers[NIRQS])(void);
+
+static inline uint32_t ic_read(uint32_t off)
+{
+	return ic[off / 4];
+}
+
+static inline void ic_write(uint32_t off, uint32_t val)
+{
+	ic[off / 4] = val;
+}
+
+void irq_init(void)
+{
+	ic = (volatile uint32_t *)mmio_map_region(IC_BASE, PGSIZE);
+#ifdef VERSATILE_PB
+	ic_write(VIC_INTENCLEAR, ~0u);
+	ic_write(VIC_INTSELECT, 0);
+#else
+	ic_write(BCM_DISABLE1, ~0u);
+	ic_write(BCM_DISABLE2, ~0u);
+#endif
+}
+
+// Call handler for each interrupt on 'irq', and unmask it.
+void irq_register(int irq, void (*handler)(void))
+{
+	assert(irq >= 0 && irq < NIRQS);
+	handlers[irq] = handler;
+#ifdef VERSATILE_PB
+	assert(irq < 32);
+	ic_write(VIC_INTENABLE, 1 << irq);
+#else
+	ic_write(irq < 32 ? BCM_ENABLE1 : BCM_ENABLE2, 1 << (irq % 32));
+#endif
+}
+
+static void irq_mask(int irq)
+{
+#ifdef VERSATILE_PB
+	ic_write(VIC_INTENCLEAR, 1 << irq);
+#else
+	ic_write(irq < 32 ? BCM_DISABLE1 : BCM_DISABLE2, 1 << (irq % 32));
+#endif
+}
+
+static void dispatch_mask(uint32_t pending, int base)
+{
+	int irq;
+
+	while (pending) {
+		irq = base + __builtin_ctz(pending);
+		pending &= pending - 1;
+		if (handlers[irq])
+			handlers[irq]();
+		else {
+			// nobody will clear it, so it would fire forever
+			klog(KLOG_WARNING, "spurious irq %d, masking it\n", irq);
+			irq_mask(irq);
+		}
+	}
+}
+
+void irq_dispatch(void)
+{
+#ifdef VERSATILE_PB
+	dispatch_mask(ic_read(VIC_IRQSTATUS), 0);
+#else
+	dispatch_mask(ic_read(BCM_PENDING1), 0);
+	dispatch_mask(ic_read(BCM_PENDING2), 32);
+#endif
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <inc/types.h>
+#include <inc/config.h>
+
+// Interrupt lines of the devices the kernel drives.
+#ifdef VERSATILE_PB
+#define IRQ_UART0 12
+#else
+#define IRQ_UART0 57
+#endif
+#define NIRQS 64
+
+void irq_init(void);
+void irq_register(int irq, void (*handler)(void));
+void irq_dispatch(void);
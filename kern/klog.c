@@ -0,0 +1,164 @@
+// Kernel log: a ring of fixed-size records that klog() fills from any
+// context, trap handlers included, without locks and without ever
+// waiting on the console. A producer claims a sequence number with an
+// atomic increment, writes the slot it maps to, and publishes the
+// record by storing seq + 1 in it.
+//
+// klog_drain, called when the kernel is idle, copies new records to the
+// console. Records the producers lapped before it got to them are
+// counted as dropped. dmesg replays whatever the ring still holds.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/stdarg.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/arm.h>
+#include <kern/klog.h>
+
+#define KLOG_NRECS 256		// a power of two
+#define KLOG_TEXT 119
+
+struct klog_rec {
+	uint32_t seq;		// sequence number + 1 once published
+	uint32_t cycles;	// cycle counter when logged
+	uint8_t level;
+	char text[KLOG_TEXT];
+};
+
+static struct klog_rec recs[KLOG_NRECS];
+static uint32_t head;		// next sequence number to hand out
+static uint32_t drained;	// next one klog_drain will print
+static uint32_t dropped;	// lapped before they were drained
+static uint32_t dropped_shown;
+
+int klog_level = KLOG_INFO;
+
+static void check_klog(void);
+
+void klog_init(void)
+{
+	check_klog();
+}
+
+void vklog(int level, const char *fmt, va_list ap)
+{
+	uint32_t seq = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+	struct klog_rec *r = &recs[seq % KLOG_NRECS];
+
+	// readers copying the old record must see it change
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r->cycles = rpmccntr();
+	r->level = level;
+	vsnprintf(r->text, sizeof(r->text), fmt, ap);
+	__atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void klog(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vklog(level, fmt, ap);
+	va_end(ap);
+}
+
+// Copy record seq to *out. Returns 1 if it was there, 0 if it hasn't
+// been published yet, and -1 if it has been overwritten.
+static int klog_read(uint32_t seq, struct klog_rec *out)
+{
+	struct klog_rec *r = &recs[seq % KLOG_NRECS];
+	uint32_t s = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+
+	if (s != seq + 1)
+		return s && (int32_t)(s - (seq + 1)) > 0 ? -1 : 0;
+	memcpy(out, r, sizeof(*out));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	// a producer may have lapped us while we copied
+	return __atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq + 1 ? 1 : -1;
+}
+
+// Skip the records producers have lapped since the last drain.
+static void klog_skip_lost(uint32_t h)
+{
+	if (h - drained > KLOG_NRECS) {
+		dropped += h - KLOG_NRECS - drained;
+		drained = h - KLOG_NRECS;
+	}
+}
+
+void klog_drain(void)
+{
+	struct klog_rec r;
+	uint32_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	int n;
+
+	klog_skip_lost(h);
+	while (drained != h) {
+		if ((n = klog_read(drained, &r)) == 0)
+			break;		// still being written
+		if (n < 0)
+			dropped++;
+		else if (r.level <= klog_level)
+			cprintf("[%10u] %s", r.cycles, r.text);
+		drained++;
+	}
+	if (dropped != dropped_shown) {
+		cprintf("klog: %u messages dropped\n", dropped - dropped_shown);
+		dropped_shown = dropped;
+	}
+}
+
+void klog_dump(void)
+{
+	struct klog_rec r;
+	uint32_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	uint32_t seq = h > KLOG_NRECS ? h - KLOG_NRECS : 0;
+
+	for (; seq != h; seq++)
+		if (klog_read(seq, &r) > 0)
+			cprintf("<%d>[%10u] %s", r.level, r.cycles, r.text);
+	cprintf("%u messages logged, %u dropped before reaching the console\n",
+		h, dropped);
+}
+
+static void
+check_klog(void)
+{
+	struct klog_rec r;
+	uint32_t h0, d0;
+	int i;
+
+	klog_drain();
+	h0 = head;
+	d0 = dropped;
+
+	// records come back in order, with their level
+	klog(KLOG_DEBUG, "check %d\n", 1);
+	klog(KLOG_DEBUG, "check %d\n", 2);
+	assert(klog_read(h0, &r) == 1 && r.level == KLOG_DEBUG);
+	assert(strcmp(r.text, "check 1\n") == 0);
+	assert(klog_read(h0 + 1, &r) == 1 && strcmp(r.text, "check 2\n") == 0);
+	assert(klog_read(h0 + 2, &r) == 0);
+
+	// long messages are cut short
+	klog(KLOG_DEBUG, "%0200d", 0);
+	assert(klog_read(h0 + 2, &r) == 1 && strlen(r.text) == KLOG_TEXT - 1);
+
+	// producers lapping the drain overwrite records, which are counted
+	for (i = 0; i < KLOG_NRECS + 5; i++)
+		klog(KLOG_DEBUG, "lap %d\n", i);
+	assert(klog_read(h0, &r) == -1);
+	assert(klog_read(head - 1, &r) == 1 && strcmp(r.text, "lap 260\n") == 0);
+	klog_skip_lost(head);
+	assert(dropped == d0 + 3 + KLOG_NRECS + 5 - KLOG_NRECS);
+	assert(drained == head - KLOG_NRECS);
+
+	// forget the test records
+	memset(recs, 0, sizeof(recs));
+	drained = head;
+	dropped = dropped_shown = d0;
+
+	cprintf("check_klog() succeeded!\n");
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <inc/types.h>
+#include <inc/stdarg.h>
+
+// Log levels, most urgent first.
+#define KLOG_ERR 3
+#define KLOG_WARNING 4
+#define KLOG_INFO 6
+#define KLOG_DEBUG 7
+
+// Messages above this level are kept but not drained to the console.
+extern int klog_level;
+
+void klog_init(void);
+void klog(int level, const char *fmt, ...);
+void vklog(int level, const char *fmt, va_list ap);
+void klog_drain(void);
+void klog_dump(void);
@@ -0,0 +1,405 @@
+// Checks and timings of the memory routines in lib/memfunc.S and the
+// word-at-a-time string routines in lib/string.c, against the
+// byte-at-a-time loops they replaced.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/arm.h>
+#include <kern/pmap.h>
+#include <kern/membench.h>
+
+// Keep the compiler from turning the reference loops back into calls.
+#define BYTEWISE __attribute__((noinline, optimize("no-tree-loop-distribute-patterns")))
+
+static BYTEWISE void
+byte_copy(char *d, const char *s, size_t n)
+{
+	if (s < d && s + n > d)
+		while (n-- > 0)
+			d[n] = s[n];
+	else
+		while (n-- > 0)
+			*d++ = *s++;
+}
+
+static BYTEWISE void
+byte_set(char *d, int c, size_t n)
+{
+	while (n-- > 0)
+		*d++ = c;
+}
+
+#define CHECK_SIZE 512
+
+static char check_buf[CHECK_SIZE], check_ref[CHECK_SIZE];
+
+static void
+check_fill(void)
+{
+	int i;
+
+	for (i = 0; i < CHECK_SIZE; i++)
+		check_buf[i] = check_ref[i] = i * 7 + 3;
+}
+
+// Every length up to a few blocks, every pair of alignments, and
+// overlaps in both directions, compared with the byte loops.
+void
+check_memfuncs(void)
+{
+	static const int shifts[] = { 1, 3, 4, 31, 32, 33 };
+	const int nshifts = sizeof(shifts) / sizeof(shifts[0]);
+	size_t n;
+	int d, s, i;
+
+	for (n = 0; n < 80; n++)
+		for (d = 0; d < 4; d++) {
+			for (s = 0; s < 4; s++) {
+				check_fill();
+				assert(memcpy(check_buf + d, check_buf + 256 + s, n)
+				       == check_buf + d);
+				byte_copy(check_ref + d, check_ref + 256 + s, n);
+				assert(memcmp(check_buf, check_ref, CHECK_SIZE) == 0);
+
+				for (i = 0; i < nshifts; i++) {
+					check_fill();
+					memmove(check_buf + 128 + d + shifts[i],
+						check_buf + 128 + s, n);
+					byte_copy(check_ref + 128 + d + shifts[i],
+						  check_ref + 128 + s, n);
+					assert(memcmp(check_buf, check_ref, CHECK_SIZE) == 0);
+
+					check_fill();
+					memmove(check_buf + 128 + d - shifts[i],
+						check_buf + 128 + s, n);
+					byte_copy(check_ref + 128 + d - shifts[i],
+						  check_ref + 128 + s, n);
+					assert(memcmp(check_buf, check_ref, CHECK_SIZE) == 0);
+				}
+			}
+			check_fill();
+			assert(memset(check_buf + d, 0x1a5, n) == check_buf + d);
+			byte_set(check_ref + d, 0xa5, n);
+			assert(memcmp(check_buf, check_ref, CHECK_SIZE) == 0);
+		}
+
+	check_fill();
+	zero_region((void *)ROUNDUP((uintptr_t)check_buf + 1, 64), 128);
+	byte_set((char *)ROUNDUP((uintptr_t)check_ref + 1, 64), 0, 128);
+	assert(memcmp(check_buf, check_ref, CHECK_SIZE) == 0);
+
+	cprintf("check_memfuncs() succeeded!\n");
+}
+
+static const size_t bench_sizes[] = { 16, 64, 256, 1024, 4096, MEM_UNIT };
+#define NSIZES (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+static const int bench_align[][2] = { { 0, 0 }, { 1, 3 }, { 0, 2 } };
+#define NALIGNS (sizeof(bench_align) / sizeof(bench_align[0]))
+
+#define BENCH_BYTES (256 * 1024)	// per measurement
+
+static uint32_t
+time_copy(void *(*fn)(void *, const void *, size_t), char *d, char *s,
+	  size_t n, int iters)
+{
+	uint32_t start = rpmccntr();
+	int i;
+
+	for (i = 0; i < iters; i++)
+		if (fn)
+			fn(d, s, n);
+		else
+			byte_copy(d, s, n);
+	return (rpmccntr() - start) / iters;
+}
+
+static uint32_t
+time_set(bool fast, char *d, size_t n, int iters)
+{
+	uint32_t start = rpmccntr();
+	int i;
+
+	for (i = 0; i < iters; i++)
+		if (fast)
+			memset(d, 0, n);
+		else
+			byte_set(d, 0, n);
+	return (rpmccntr() - start) / iters;
+}
+
+// The string routines as they were, a byte at a time.
+static BYTEWISE int
+ref_strlen(const char *s)
+{
+	int n;
+
+	for (n = 0; *s != '\0'; s++)
+		n++;
+	return n;
+}
+
+static BYTEWISE int
+ref_strnlen(const char *s, size_t size)
+{
+	int n;
+
+	for (n = 0; size > 0 && *s != '\0'; s++, size--)
+		n++;
+	return n;
+}
+
+static BYTEWISE int
+ref_strncmp(const char *p, const char *q, size_t n)
+{
+	while (n > 0 && *p && *p == *q)
+		n--, p++, q++;
+	if (n == 0)
+		return 0;
+	else
+		return (int) ((unsigned char) *p - (unsigned char) *q);
+}
+
+static BYTEWISE char *
+ref_strfind(const char *s, char c)
+{
+	for (; *s; s++)
+		if (*s == c)
+			break;
+	return (char *) s;
+}
+
+static BYTEWISE int
+ref_memcmp(const void *v1, const void *v2, size_t n)
+{
+	const uint8_t *s1 = (const uint8_t *) v1;
+	const uint8_t *s2 = (const uint8_t *) v2;
+
+	while (n-- > 0) {
+		if (*s1 != *s2)
+			return (int) *s1 - (int) *s2;
+		s1++, s2++;
+	}
+	return 0;
+}
+
+static BYTEWISE void *
+ref_memfind(const void *s, int c, size_t n)
+{
+	const void *ends = (const char *) s + n;
+
+	for (; s < ends; s++)
+		if (*(const unsigned char *) s == (unsigned char) c)
+			break;
+	return (void *) s;
+}
+
+// Compare s, of length len, with t in every routine; t differs from
+// it at most where the caller changed it.
+static void
+check_string_pair(const char *s, const char *t, size_t len)
+{
+	size_t n;
+
+	assert(strcmp(s, t) == ref_strncmp(s, t, ~(size_t)0));
+	assert(strcmp(t, s) == ref_strncmp(t, s, ~(size_t)0));
+	for (n = 0; n <= len + 1; n++) {
+		assert(strncmp(s, t, n) == ref_strncmp(s, t, n));
+		assert(strncmp(t, s, n) == ref_strncmp(t, s, n));
+		assert(memcmp(s, t, n) == ref_memcmp(s, t, n));
+		assert(memcmp(t, s, n) == ref_memcmp(t, s, n));
+	}
+}
+
+// Run the string routines on a string of each length ending at the
+// last byte of page, and on one starting at each offset into it.
+// Neither neighbour of page may be mapped: a read past either end
+// faults.
+static void
+check_string_page(char *page)
+{
+	const char cs[] = { 1, 'a', (char)0x80, (char)0xff };
+	char *s, *t;
+	size_t len, n, i, j;
+	int where, c;
+
+	for (len = 0; len < 40; len++)
+		for (where = 0; where < 5; where++) {
+			s = where == 4 ? page + PGSIZE - len - 1 : page + where;
+			for (i = 0; i < len; i++)
+				s[i] = 2 + (i * 37 + len) % 250;
+			s[len] = '\0';
+
+			assert(strlen(s) == len);
+			for (n = 0; n <= len + 1; n++)
+				assert(strnlen(s, n) == ref_strnlen(s, n));
+			if (len > 0)
+				// stopped by the size alone
+				assert(strnlen(s + 1, len - 1) == len - 1);
+			for (i = 0; i <= len; i++) {
+				c = s[i];
+				assert(strfind(s, c) == ref_strfind(s, c));
+				assert(strchr(s, c) == (c ? ref_strfind(s, c) : NULL));
+				assert(memfind(s, c, len + 1) == ref_memfind(s, c, len + 1));
+			}
+			for (i = 0; i < sizeof(cs); i++) {
+				assert(strfind(s, cs[i]) == ref_strfind(s, cs[i]));
+				assert(strchr(s, cs[i]) == (*ref_strfind(s, cs[i]) ?
+				       ref_strfind(s, cs[i]) : NULL));
+				assert(memfind(s, cs[i], len + 1) ==
+				       ref_memfind(s, cs[i], len + 1));
+			}
+
+			// against copies at each alignment, with a byte
+			// changed or cut short
+			for (i = 0; i < 4; i++) {
+				t = check_buf + 64 + i;
+				memcpy(t, s, len + 1);
+				check_string_pair(s, t, len);
+				for (j = 0; j < len; j += 1 + len / 5) {
+					t[j]++;
+					check_string_pair(s, t, len);
+					t[j] = '\0';
+					check_string_pair(s, t, len);
+					t[j] = s[j];
+				}
+			}
+		}
+}
+
+#define CHECK_VA 0x10000000
+
+// The word-at-a-time string routines against the byte loops, in a
+// page mapped on its own so that reading past a string's page faults.
+void
+check_string(void)
+{
+	struct mem_region *rg;
+	pte_t *pte;
+
+	assert((rg = region_alloc(0)) != NULL);
+	assert(region_insert(kern_pgdir, rg, CHECK_VA, PTE_NONE_U) == 0);
+	assert(!region_lookup(kern_pgdir, CHECK_VA - PGSIZE, &pte));
+	assert(!region_lookup(kern_pgdir, CHECK_VA + PGSIZE, &pte));
+	check_string_page((char *)CHECK_VA);
+	region_remove(kern_pgdir, CHECK_VA);
+
+	cprintf("check_string() succeeded!\n");
+}
+
+static void
+print_speedup(uint32_t fast, uint32_t slow)
+{
+	uint32_t x10 = fast ? slow * 10 / fast : 0;
+
+	cprintf(" %8u %3u.%ux", fast, x10 / 10, x10 % 10);
+}
+
+// Cycles per call at several sizes and alignments, and the speedup
+// over the byte loops. memmove moves its block up by 8 bytes, so it
+// takes the backwards path.
+void
+mem_bench(void)
+{
+	struct mem_region *rg;
+	char *buf, *d, *s;
+	uint32_t start, fast, slow;
+	int i, j, iters;
+	size_t n;
+
+	if ((rg = region_alloc_order(2, 0)) == NULL) {
+		cprintf("membench: out of memory\n");
+		return;
+	}
+	buf = (char *)region2kva(rg);
+
+	cprintf("%6s %5s %15s %15s %15s\n", "size", "align", "memcpy",
+		"memmove", "memset");
+	for (i = 0; i < NSIZES; i++)
+		for (j = 0; j < NALIGNS; j++) {
+			n = bench_sizes[i];
+			iters = MAX(BENCH_BYTES / n, 1);
+			d = buf + bench_align[j][0];
+			s = buf + 2 * MEM_UNIT + bench_align[j][1];
+			cprintf("%6u %2d/%-2d", n, bench_align[j][0],
+				bench_align[j][1]);
+			fast = time_copy(memcpy, d, s, n, iters);
+			slow = time_copy(NULL, d, s, n, iters);
+			print_speedup(fast, slow);
+			fast = time_copy(memmove, s + 8, s, n, iters);
+			slow = time_copy(NULL, s + 8, s, n, iters);
+			print_speedup(fast, slow);
+			fast = time_set(true, d, n, iters);
+			slow = time_set(false, d, n, iters);
+			print_speedup(fast, slow);
+			cprintf("\n");
+		}
+
+	iters = BENCH_BYTES / MEM_UNIT;
+	start = rpmccntr();
+	for (i = 0; i < iters; i++)
+		zero_region(buf, MEM_UNIT);
+	cprintf("zero_region(%u): %u cycles\n", MEM_UNIT,
+		(rpmccntr() - start) / iters);
+
+	region_free_order(rg, 2);
+}
+
+#define STRBENCH_BYTES (64 * 1024)	// per measurement
+
+// Cycles per call of the string routines at several lengths, and the
+// speedup over the byte loops. The strings are all 'x', and the
+// searches look for a byte that isn't there.
+void
+str_bench(void)
+{
+	static const size_t sizes[] = { 8, 64, 512, 4096 };
+	const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+	struct mem_region *rg;
+	char *p, *q;
+	uint32_t start, fast, slow;
+	int i, k, iters;
+	size_t n;
+
+	if ((rg = region_alloc_order(1, 0)) == NULL) {
+		cprintf("strbench: out of memory\n");
+		return;
+	}
+	p = (char *)region2kva(rg);
+	q = p + MEM_UNIT + 1;
+
+	cprintf("%6s %15s %15s %15s %15s\n", "size", "strlen", "strcmp",
+		"strchr", "memcmp");
+	for (i = 0; i < nsizes; i++) {
+		n = sizes[i];
+		iters = MAX(STRBENCH_BYTES / n, 1);
+		memset(p, 'x', n);
+		memset(q, 'x', n);
+		p[n] = q[n] = '\0';
+		cprintf("%6u", n);
+
+#define TIME(expr) ({							\
+		start = rpmccntr();					\
+		for (k = 0; k < iters; k++)				\
+			(void)(expr);					\
+		(rpmccntr() - start) / iters;				\
+	})
+		fast = TIME(strlen(p));
+		slow = TIME(ref_strlen(p));
+		print_speedup(fast, slow);
+		fast = TIME(strcmp(p, q));
+		slow = TIME(ref_strncmp(p, q, ~(size_t)0));
+		print_speedup(fast, slow);
+		fast = TIME(strchr(p, 'y'));
+		slow = TIME(ref_strfind(p, 'y'));
+		print_speedup(fast, slow);
+		fast = TIME(memcmp(p, q, n));
+		slow = TIME(ref_memcmp(p, q, n));
+		print_speedup(fast, slow);
+#undef TIME
+		cprintf("\n");
+	}
+
+	region_free_order(rg, 1);
+}
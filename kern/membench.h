@@ -0,0 +1,6 @@
+#pragma once
+
+void check_memfuncs(void);
+void mem_bench(void);
+void check_string(void);
+void str_bench(void);
@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+
+# Generate the boot first-level page table, kern_pgdir, for the RAM size
+# and board the kernel is configured for. It maps:
+#
+#   - the first 16MiB at 0, for entry.S until it jumps to KERNBASE;
+#   - RAM at KERNBASE, with 16MiB supersections wherever it can. The
+#     first 16MiB, which holds the kernel image, is mapped with 1MiB
+#     sections instead, so mem_init can remap the image with pages
+#     without touching a mapping it is running from;
+#   - the console and the boot stack.
+#
+# mem_init only fixes up the direct map if the bootloader reports a
+# different amount of RAM.
+
+import argparse
+import re
+import sys
+
+PTSIZE = 1 << 20
+SSECTSIZE = 16 * PTSIZE
+
+NORMAL = 'PDE_MEM_NORMAL'
+KERNEL = 'PDE_NONE_U'
+
+
+def kernbase(memlayout):
+	with open(memlayout) as f:
+		m = re.search(r'#define\s+KERNBASE\s+(0x[0-9a-fA-F]+)', f.read())
+	if not m:
+		sys.exit('mkpgdir: no KERNBASE in ' + memlayout)
+	return int(m.group(1), 16)
+
+
+def section(pa, *flags):
+	return '0x%08x | %s' % (pa, ' | '.join(('PDE_ENTRY_1M',) + flags))
+
+
+def supersection(pa, *flags):
+	return '0x%08x | %s' % (pa, ' | '.join(('PDE_ENTRY_16M',) + flags))
+
+
+def direct_map(base, memsize):
+	entries = []
+	pa = 0
+	while pa < memsize:
+		va = base + pa
+		if pa >= SSECTSIZE and memsize - pa >= SSECTSIZE:
+			entries.append(('0x%03x ... 0x%03x' % (va >> 20, (va >> 20) + 15),
+					supersection(pa, KERNEL, NORMAL, 'PDE_XN')))
+			pa += SSECTSIZE
+		else:
+			# the kernel image's 16MiB stays executable until
+			# mem_init has remapped it
+			xn = () if pa < SSECTSIZE else ('PDE_XN',)
+			entries.append(('0x%03x' % (va >> 20),
+					section(pa, KERNEL, NORMAL, *xn)))
+			pa += PTSIZE
+	return entries
+
+
+def main():
+	ap = argparse.ArgumentParser()
+	ap.add_argument('--mem-mb', type=int, required=True,
+			help='RAM size in MiB')
+	ap.add_argument('--versatile-pb', action='store_true',
+			help='build for the Versatile PB rather than the Raspberry Pi')
+	ap.add_argument('--memlayout', required=True, help='path to inc/memlayout.h')
+	ap.add_argument('-o', '--output', required=True)
+	args = ap.parse_args()
+
+	base = kernbase(args.memlayout)
+	memsize = min(args.mem_mb * PTSIZE, (1 << 32) - base)
+	console = 0x10100000 if args.versatile_pb else 0x20200000
+
+	out = []
+	out.append('// Generated by kern/mkpgdir.py for %dMiB of RAM on the %s; do not edit.'
+		   % (memsize // PTSIZE,
+		      'Versatile PB' if args.versatile_pb else 'Raspberry Pi'))
+	out.append('#include <inc/types.h>')
+	out.append('#include <inc/memlayout.h>')
+	out.append('#include <kern/pmap.h>')
+	out.append('')
+	out.append('// RAM the direct map below covers')
+	out.append('const physaddr_t boot_directmap_size = 0x%08x;' % memsize)
+	out.append('')
+	out.append('extern uint8_t bootstack[];')
+	out.append('pde_t kern_pgdir[NPDENTRIES] __attribute__((aligned(16 * 1024))) = {')
+	out.append('\t// identity map for entry.S')
+	out.append('\t[0x000 ... 0x00f] = %s,' % supersection(0, NORMAL))
+	out.append('\t// RAM')
+	for index, value in direct_map(base, memsize):
+		out.append('\t[%s] = %s,' % (index, value))
+	out.append('\t[PDX(MCONSOLE)] = %s,'
+		   % section(console, KERNEL, 'PDE_MEM_DEVICE', 'PDE_XN'))
+	out.append('\t[PDX(KSTACKTOP - 1)] = PADDR(bootstack) +')
+	out.append('\t\t(PDE_ENTRY_1M | %s | %s | PDE_XN),' % (KERNEL, NORMAL))
+	out.append('};')
+
+	with open(args.output, 'w') as f:
+		f.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+	main()
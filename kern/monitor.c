@@ -8,8 +8,16 @@
 
 #include <kern/console.h>
 #include <kern/monitor.h>
+#include <kern/pmap.h>
+#include <kern/slab.h>
+#include <kern/allocstat.h>
+#include <kern/tlb.h>
+#include <kern/cache.h>
 //#include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/klog.h>
+#include <kern/trace.h>
+#include <kern/membench.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -24,6 +32,18 @@ struct Command {
 static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
+	{ "zpool", "Display pre-zeroed region pool statistics", mon_zpool },
+	{ "slabinfo", "Display slab cache utilization", mon_slabinfo },
+	{ "allocstat", "Display allocator statistics ('reset' clears them)", mon_allocstat },
+	{ "tlb", "Display TLB flush statistics, or set the full flush threshold", mon_tlb },
+	{ "asidbench", "Time address space switches with and without ASIDs", mon_asidbench },
+	{ "cache", "Display the caches and whether they are on", mon_cache },
+	{ "trapstat", "Display exception counts and cycles ('reset' clears them)", mon_trapstat },
+	{ "trapbench", "Time a null supervisor call round trip", mon_trapbench },
+	{ "dmesg", "Replay the kernel log (a level sets what reaches the console)", mon_dmesg },
+	{ "trace", "Trace events: 'on [events]', 'off', 'clear', or show [events]", mon_trace },
+	{ "membench", "Time memcpy, memmove and memset against byte loops", mon_membench },
+	{ "strbench", "Time strlen, strcmp, strchr and memcmp against byte loops", mon_strbench },
 	//{ "backtrace", "Display backtrace", mon_backtrace }
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
@@ -55,6 +75,126 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_zpool(int argc, char **argv, struct Trapframe *tf)
+{
+	zpool_print_stats();
+	return 0;
+}
+
+int
+mon_slabinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	slab_print_info();
+	return 0;
+}
+
+int
+mon_allocstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1 && strcmp(argv[1], "reset") == 0)
+		allocstat_reset();
+	else
+		allocstat_print();
+	return 0;
+}
+
+int
+mon_tlb(int argc, char **argv, struct Trapframe *tf)
+{
+	int threshold;
+
+	if (argc > 1) {
+		if ((threshold = strtol(argv[1], NULL, 0)) <= 0) {
+			cprintf("Bad threshold '%s'\n", argv[1]);
+			return 0;
+		}
+		tlb_threshold = threshold;
+	}
+	tlb_print_stats();
+	return 0;
+}
+
+int
+mon_asidbench(int argc, char **argv, struct Trapframe *tf)
+{
+	int iters = argc > 1 ? strtol(argv[1], NULL, 0) : 1000;
+
+	if (iters <= 0)
+		iters = 1000;
+	asid_bench(iters);
+	return 0;
+}
+
+int
+mon_cache(int argc, char **argv, struct Trapframe *tf)
+{
+	cache_print_info();
+	return 0;
+}
+
+int
+mon_trapstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1 && strcmp(argv[1], "reset") == 0)
+		trap_reset_stats();
+	else
+		trap_print_stats();
+	return 0;
+}
+
+int
+mon_trapbench(int argc, char **argv, struct Trapframe *tf)
+{
+	int iters = argc > 1 ? strtol(argv[1], NULL, 0) : 1000;
+
+	if (iters <= 0)
+		iters = 1000;
+	trap_bench(iters);
+	return 0;
+}
+
+int
+mon_dmesg(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1)
+		klog_level = strtol(argv[1], NULL, 0);
+	else
+		klog_dump();
+	return 0;
+}
+
+int
+mon_trace(int argc, char **argv, struct Trapframe *tf)
+{
+	uint32_t mask;
+
+	if (argc > 1 && strcmp(argv[1], "off") == 0)
+		trace_stop();
+	else if (argc > 1 && strcmp(argv[1], "clear") == 0)
+		trace_clear();
+	else if (argc > 1 && strcmp(argv[1], "on") == 0) {
+		if (trace_parse(argc - 2, argv + 2, &mask) == 0)
+			trace_start(mask);
+	} else if (trace_parse(argc - 1, argv + 1, &mask) == 0)
+		trace_dump(mask);
+	return 0;
+}
+
+int
+mon_membench(int argc, char **argv, struct Trapframe *tf)
+{
+	mem_bench();
+	return 0;
+}
+
+int
+mon_strbench(int argc, char **argv, struct Trapframe *tf)
+{
+	str_bench();
+	return 0;
+}
+
 /*
 int
 mon_backtrace(int argc, char **argv, struct Trapframe *tf)
@@ -132,6 +272,8 @@ monitor(struct Trapframe *tf)
 		print_trapframe(tf);
 
 	while (1) {
+		// the monitor is about to wait for input: do idle work now
+		region_zero_idle();
 		buf = readline("K> ");
 		if (buf != NULL)
 			if (runcmd(buf, tf) < 0)
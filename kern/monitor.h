@@ -14,6 +14,18 @@ void monitor(struct Trapframe *tf);
 // Functions implementing monitor commands.
 int mon_help(int argc, char **argv, struct Trapframe *tf);
 int mon_kerninfo(int argc, char **argv, struct Trapframe *tf);
+int mon_zpool(int argc, char **argv, struct Trapframe *tf);
+int mon_slabinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_allocstat(int argc, char **argv, struct Trapframe *tf);
+int mon_tlb(int argc, char **argv, struct Trapframe *tf);
+int mon_asidbench(int argc, char **argv, struct Trapframe *tf);
+int mon_cache(int argc, char **argv, struct Trapframe *tf);
+int mon_trapstat(int argc, char **argv, struct Trapframe *tf);
+int mon_trapbench(int argc, char **argv, struct Trapframe *tf);
+int mon_dmesg(int argc, char **argv, struct Trapframe *tf);
+int mon_trace(int argc, char **argv, struct Trapframe *tf);
+int mon_membench(int argc, char **argv, struct Trapframe *tf);
+int mon_strbench(int argc, char **argv, struct Trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 int mon_color(int argc, char **argv, struct Trapframe *tf);
 
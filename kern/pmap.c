@@ -3,93 +3,308 @@
 #include <inc/string.h>
 #include <inc/assert.h>
 #include <inc/error.h>
+#include <inc/arm.h>
 #include <kern/pmap.h>
-
-// Memory mapping when booting.
-// map [0, 16MiB) to [KERNBASE, KERNBASE + 16MiB)
-#define PADDR(kva) ((uintptr_t)(kva) - KERNBASE)
-#define KADDR(pa) ((uintptr_t)(pa) + KERNBASE)
-
-extern uint8_t bootstack[];
-pde_t kern_pgdir[4096] __attribute__((aligned(16 * 1024))) = {
-	[0x0] = 0x00000002,
-	[0x1] = 0x00100002,
-	[0x2] = 0x00200002,
-	[0x3] = 0x00300002,
-	[0x4] = 0x00400002,
-	[0x5] = 0x00500002,
-	[0x6] = 0x00600002,
-	[0x7] = 0x00700002,
-	[0x8] = 0x00800002,
-	[0x9] = 0x00900002,
-	[0xa] = 0x00a00002,
-	[0xb] = 0x00b00002,
-	[0xc] = 0x00c00002,
-	[0xd] = 0x00d00002,
-	[0xe] = 0x00e00002,
-	[0xf] = 0x00f00002,
-#ifdef VERSATILE_PB
-    [MCONSOLE >> 20] = 0x10100002,
-#else
-	[MCONSOLE >> 20] = 0x20200002,
-#endif
-    [(KSTACKTOP - 1) >> 20] = PADDR(bootstack) + 2,
-	[0xf00] = 0x00000002,
-	[0xf01] = 0x00100002,
-	[0xf02] = 0x00200002,
-	[0xf03] = 0x00300002,
-	[0xf04] = 0x00400002,
-	[0xf05] = 0x00500002,
-	[0xf06] = 0x00600002,
-	[0xf07] = 0x00700002,
-	[0xf08] = 0x00800002,
-	[0xf09] = 0x00900002,
-	[0xf0a] = 0x00a00002,
-	[0xf0b] = 0x00b00002,
-	[0xf0c] = 0x00c00002,
-	[0xf0d] = 0x00d00002,
-	[0xf0e] = 0x00e00002,
-	[0xf0f] = 0x00f00002,
+#include <kern/bootinfo.h>
+#include <kern/allocstat.h>
+#include <kern/trace.h>
+#include <kern/tlb.h>
+#include <kern/cache.h>
+#include <kern/slab.h>
+
+// kern_pgdir, the boot page table, is generated at build time by
+// kern/mkpgdir.py. RAM is normal write-back memory and the console
+// device memory, so both are right once cache_init turns the caches
+// on. mem_init maps the kernel image with proper permissions later.
+
+// One mem_region per MEM_UNIT of RAM, allocated at boot once the
+// amount of RAM is known.
+struct mem_region *regions;
+size_t nregions;
+
+// Buddy allocator: free_area[k] lists the free blocks of
+// MEM_UNIT << k bytes, each aligned to its own size.
+struct free_area {
+	struct mem_region *head;
+	int nfree;
 };
+static struct free_area free_area[REGION_MAX_ORDER + 1];
+
+// Free memory the buddy allocator hasn't been handed yet is kept as a
+// sorted array of extents, so boot doesn't touch every region and big
+// ranges are allocated and freed in one step. Metadata of the regions
+// inside an extent is not maintained: it is set up when they are
+// carved out.
+#define MAX_EXTENTS 64
+struct mem_extent {
+	uint32_t start;		// first region
+	uint32_t len;		// number of regions
+};
+static struct mem_extent extents[MAX_EXTENTS];
+static int nextents;
+static uint32_t extent_free;	// regions held in extents
+
+// Region metadata is cleared a top-order block at a time, the first
+// time anything in the block is handed out, rather than for all of RAM
+// at boot. Buddies never cross a top-order block, so merging only
+// looks at metadata that has been cleared.
+#define NTOPBLOCKS ((DIRECTMAP_MAX / MEM_UNIT) >> REGION_MAX_ORDER)
+static uint32_t topblock_ready[(NTOPBLOCKS + 31) / 32];
+
+// Pool of regions zeroed ahead of time, so that ALLOC_ZERO requests
+// don't pay for a MEM_UNIT memset. It is topped up in batches when it
+// drops below ZPOOL_LOW, and up to ZPOOL_HIGH when the kernel is idle.
+#define ZPOOL_LOW 8
+#define ZPOOL_BATCH 16
+#define ZPOOL_HIGH 64
+static struct {
+	struct mem_region *head;
+	int n;
+	uint32_t hits, misses;
+	uint32_t refills, zeroed;
+	uint64_t refill_cycles;
+} zpool;
+static void zpool_refill(int target);
+static void zpool_drain(void);
+static void free_order(struct mem_region *r, int order);
+
+// regions held by the buddy allocator and the extents
+static int
+count_free_regions(void)
+{
+	int n = extent_free;
+
+	for (int o = 0; o <= REGION_MAX_ORDER; o++)
+		n += free_area[o].nfree << o;
+	return n;
+}
+
+// everything that can still be handed out
+int
+nfree_regions(void)
+{
+	return count_free_regions() + zpool.n;
+}
 
-#define TOTAL_PHYS_MEM (256 * 1024 * 1024)
-#define MEM_UNIT (16 * 1024)
-#define MAX_REGION (TOTAL_PHYS_MEM / MEM_UNIT)
-struct mem_region regions[MAX_REGION], *free_regions;
+// Regions holding page tables that still have free slots.
+static struct mem_region *l2_partial;
+
+static void directmap_fixup(physaddr_t memsize);
+static void map_kernel_image(void);
 
 static void check_free_regions();
 static void check_region_alloc(void);
 static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_region(void);
+static void check_region_map(void);
+static void check_region_cow(void);
 static void check_region_installed_pgdir(void);
 
-static inline struct mem_region *pa2region(physaddr_t pa)
+static void free_area_push(struct mem_region *r, int order)
 {
-	return &regions[pa / MEM_UNIT];
+	struct free_area *fa = &free_area[order];
+
+	r->order = order;
+	r->flags |= REGION_FREE;
+	r->prev = NULL;
+	r->next = fa->head;
+	if (fa->head)
+		fa->head->prev = r;
+	fa->head = r;
+	fa->nfree++;
 }
 
-static inline physaddr_t region2pa(struct mem_region *r)
+static void free_area_remove(struct mem_region *r)
 {
-	return MEM_UNIT * (r - regions);
+	struct free_area *fa = &free_area[r->order];
+
+	if (r->prev)
+		r->prev->next = r->next;
+	else
+		fa->head = r->next;
+	if (r->next)
+		r->next->prev = r->prev;
+	r->next = r->prev = NULL;
+	r->flags &= ~REGION_FREE;
+	fa->nfree--;
 }
 
-static inline uintptr_t region2kva(struct mem_region *r) {
-    return region2pa(r) + KERNBASE;
+// Add [start, start + len) to the extents, merging with neighbours.
+// Fails only if the extent array is full.
+static bool extent_insert(uint32_t start, uint32_t len)
+{
+	int lo = 0, hi = nextents;
+	bool merge_prev, merge_next;
+
+	// find the first extent after start
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (extents[mid].start < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	assert(lo == 0 || extents[lo - 1].start + extents[lo - 1].len <= start);
+	assert(lo == nextents || start + len <= extents[lo].start);
+
+	merge_prev = lo > 0 && extents[lo - 1].start + extents[lo - 1].len == start;
+	merge_next = lo < nextents && start + len == extents[lo].start;
+	if (merge_prev && merge_next) {
+		extents[lo - 1].len += len + extents[lo].len;
+		memmove(&extents[lo], &extents[lo + 1],
+			(nextents - lo - 1) * sizeof(extents[0]));
+		nextents--;
+	} else if (merge_prev) {
+		extents[lo - 1].len += len;
+	} else if (merge_next) {
+		extents[lo].start = start;
+		extents[lo].len += len;
+	} else {
+		if (nextents == MAX_EXTENTS)
+			return false;
+		memmove(&extents[lo + 1], &extents[lo],
+			(nextents - lo) * sizeof(extents[0]));
+		extents[lo].start = start;
+		extents[lo].len = len;
+		nextents++;
+	}
+	extent_free += len;
+	return true;
 }
-void region_init()
+
+// clear the metadata of the top-order blocks around [start, start + n)
+// that haven't been used yet
+static void topblock_prepare(uint32_t start, uint32_t n)
+{
+	uint32_t b, first;
+
+	for (b = start >> REGION_MAX_ORDER;
+	     b <= (start + n - 1) >> REGION_MAX_ORDER; b++) {
+		if (topblock_ready[b / 32] & (1u << b % 32))
+			continue;
+		topblock_ready[b / 32] |= 1u << b % 32;
+		first = b << REGION_MAX_ORDER;
+		memset(&regions[first], 0, MIN(1u << REGION_MAX_ORDER,
+		       nregions - first) * sizeof(regions[0]));
+	}
+}
+
+// take n regions off the front of extent i
+static uint32_t extent_take(int i, uint32_t n)
+{
+	uint32_t start = extents[i].start;
+
+	assert(n <= extents[i].len);
+	extents[i].start += n;
+	extents[i].len -= n;
+	if (extents[i].len == 0) {
+		memmove(&extents[i], &extents[i + 1],
+			(nextents - i - 1) * sizeof(extents[0]));
+		nextents--;
+	}
+	extent_free -= n;
+	topblock_prepare(start, n);
+	memset(&regions[start], 0, n * sizeof(regions[0]));
+	return start;
+}
+
+// Move blocks from the front of the extents to the buddy free lists
+// until one of at least 'order' is available. Each block is the
+// largest aligned one at the front of its extent, so an extent is
+// naturally aligned after at most REGION_MAX_ORDER carves.
+static bool extent_carve(int order)
+{
+	while (nextents > 0) {
+		struct mem_extent *e = &extents[0];
+		int o = 31 - __builtin_clz(e->len);
+
+		if (e->start)
+			o = MIN(o, __builtin_ctz(e->start));
+		o = MIN(o, REGION_MAX_ORDER);
+		free_area_push(&regions[extent_take(0, 1 << o)], o);
+		if (o >= order)
+			return true;
+	}
+	return false;
+}
+
+// Give [start, start + len) back. Ranges the extent array has no
+// room for go to the buddy allocator instead.
+static void free_to_extents(uint32_t start, uint32_t len)
+{
+	if (extent_insert(start, len))
+		return;
+	memset(&regions[start], 0, len * sizeof(regions[0]));
+	while (len > 0) {
+		int o = MIN(31 - __builtin_clz(len), REGION_MAX_ORDER);
+
+		if (start)
+			o = MIN(o, __builtin_ctz(start));
+		free_order(&regions[start], o);
+		start += 1 << o;
+		len -= 1 << o;
+	}
+}
+
+// Bump allocator for the boot-time data structures sized from the
+// amount of RAM. Only used before region_init.
+static void *boot_alloc(size_t n)
 {
 	extern char end[];
-	for (physaddr_t addr = 0; addr < TOTAL_PHYS_MEM; addr += MEM_UNIT) {
-		struct mem_region *r = pa2region(addr);
-		if (0x100000 <= addr && addr < PADDR(end)) {
-			r->refn = 1;
-		} else {
-			r->refn = 0;
-			r->next = free_regions;
-			free_regions = r;
-		}
+	static char *nextfree;
+	char *result;
+
+	if (!nextfree)
+		nextfree = ROUNDUP((char *)end, PGSIZE);
+	result = nextfree;
+	nextfree = ROUNDUP(nextfree + n, PGSIZE);
+	if (PADDR(nextfree) > nregions * MEM_UNIT)
+		panic("boot_alloc: out of memory");
+	return result;
+}
+
+void region_init()
+{
+	uint32_t kstart = 0x100000 / MEM_UNIT;
+	uint32_t kend = ROUNDUP(PADDR(boot_alloc(0)), MEM_UNIT) / MEM_UNIT;
+
+	topblock_prepare(kstart, kend - kstart);
+	for (uint32_t i = kstart; i < kend; i++)
+		regions[i].refn = 1;
+	free_to_extents(0, kstart);
+	free_to_extents(kend, nregions - kend);
+}
+
+// Allocate n physically contiguous regions straight from the extents.
+// Only memory the buddy allocator doesn't hold is considered.
+struct mem_region *region_alloc_range(size_t n, int alloc_flags)
+{
+	struct mem_region *ret;
+	int i;
+
+	if (n == 0)
+		return NULL;
+	for (i = 0; i < nextents; i++)
+		if (extents[i].len >= n)
+			break;
+	if (i == nextents)
+		return NULL;
+	ret = &regions[extent_take(i, n)];
+	if (alloc_flags & ALLOC_ZERO)
+		zero_region((void *)region2kva(ret), n * MEM_UNIT);
+	return ret;
+}
+
+// Free n contiguous regions in one step.
+void region_free_range(struct mem_region *r, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		assert(r[i].refn == 0);
+		assert(r[i].next == NULL);
+		assert(!(r[i].flags & REGION_FREE));
 	}
+	free_to_extents(r - regions, n);
 }
 
 static void set_domain(int did, int priv) {
@@ -104,154 +319,1441 @@ static void set_domain(int did, int priv) {
         : "r0");
 }
 
+// take a block of 'order' off the free lists, carving the extents
+// if none is left
+static struct mem_region *buddy_alloc(int order)
+{
+	struct mem_region *ret;
+	int o;
+
+	for (;;) {
+		for (o = order; o <= REGION_MAX_ORDER; o++)
+			if (free_area[o].head)
+				break;
+		if (o <= REGION_MAX_ORDER)
+			break;
+		if (!extent_carve(order))
+			return NULL;
+	}
+
+	ret = free_area[o].head;
+	free_area_remove(ret);
+	// split, handing the upper halves back
+	while (o > order) {
+		o--;
+		ret[1 << o].refn = 0;
+		free_area_push(&ret[1 << o], o);
+	}
+	return ret;
+}
+
+static struct mem_region *alloc_order(int order, int alloc_flags)
+{
+	struct mem_region *ret;
+
+	if (order < 0 || order > REGION_MAX_ORDER)
+		return NULL;
+	if ((ret = buddy_alloc(order)) == NULL && zpool.head) {
+		// pre-zeroed regions are better spent than failing
+		zpool_drain();
+		ret = buddy_alloc(order);
+	}
+	if (ret == NULL)
+		return NULL;
+
+	if (alloc_flags & ALLOC_ZERO)
+		zero_region((void *)region2kva(ret), MEM_UNIT << order);
+	return ret;
+}
+
+// allocate a block of (1 << order) contiguous mem_regions,
+// aligned to its size
+struct mem_region *region_alloc_order(int order, int alloc_flags)
+{
+	struct mem_region *ret;
+	ALLOCSTAT_BEGIN();
+
+	ret = alloc_order(order, alloc_flags);
+	ALLOCSTAT_END(AS_ALLOC);
+	TRACE(TR_ALLOC, ret ? region2pa(ret) : 0, order);
+	ALLOCSTAT_LEVEL(nfree_regions());
+	return ret;
+}
+
+static struct mem_region *alloc_one(int alloc_flags)
+{
+	struct mem_region *ret;
+
+	if (!(alloc_flags & ALLOC_ZERO))
+		return alloc_order(0, 0);
+
+	if ((ret = zpool.head) != NULL) {
+		zpool.head = ret->next;
+		zpool.n--;
+		ret->next = NULL;
+		zpool.hits++;
+	} else {
+		zpool.misses++;
+		if ((ret = alloc_order(0, ALLOC_ZERO)) == NULL)
+			return NULL;
+	}
+	if (zpool.n < ZPOOL_LOW)
+		zpool_refill(zpool.n + ZPOOL_BATCH);
+	return ret;
+}
+
 // allocate a mem_region
 struct mem_region *region_alloc(int alloc_flags)
 {
-	if (free_regions == NULL)
-	    return NULL;
+	struct mem_region *ret;
+	ALLOCSTAT_BEGIN();
 
-	struct mem_region *ret = free_regions;
-	free_regions = ret->next;
-	ret->next = NULL;
-	
-	if (alloc_flags & ALLOC_ZERO)
-	    memset((void *)KADDR(region2pa(ret)), 0, MEM_UNIT);
+	ret = alloc_one(alloc_flags);
+	ALLOCSTAT_END(AS_ALLOC);
+	TRACE(TR_ALLOC, ret ? region2pa(ret) : 0, 0);
+	ALLOCSTAT_LEVEL(nfree_regions());
 	return ret;
 }
 
-void region_free(struct mem_region *r)
+// zero fresh regions onto the pool until it holds target regions
+static void zpool_refill(int target)
+{
+	struct mem_region *r;
+	uint32_t start = rpmccntr();
+
+	if (zpool.n >= target)
+		return;
+	while (zpool.n < target && (r = buddy_alloc(0)) != NULL) {
+		zero_region((void *)region2kva(r), MEM_UNIT);
+		r->next = zpool.head;
+		zpool.head = r;
+		zpool.n++;
+		zpool.zeroed++;
+	}
+	zpool.refills++;
+	zpool.refill_cycles += rpmccntr() - start;
+}
+
+// hand every pooled region back to the buddy allocator
+static void zpool_drain(void)
+{
+	struct mem_region *r;
+
+	while ((r = zpool.head) != NULL) {
+		zpool.head = r->next;
+		zpool.n--;
+		r->next = NULL;
+		free_order(r, 0);
+	}
+}
+
+// top the zero pool up; called when the kernel has nothing better to do
+void region_zero_idle(void)
 {
+	zpool_refill(ZPOOL_HIGH);
+}
+
+void zpool_print_stats(void)
+{
+	uint32_t total = zpool.hits + zpool.misses;
+
+	cprintf("zero pool: %d regions (low %d, high %d)\n",
+		zpool.n, ZPOOL_LOW, ZPOOL_HIGH);
+	cprintf("  requests %u  hits %u  misses %u  hit rate %u%%\n",
+		total, zpool.hits, zpool.misses,
+		total ? zpool.hits * 100 / total : 0);
+	cprintf("  refills %u  regions zeroed %u  cycles %llu",
+		zpool.refills, zpool.zeroed, zpool.refill_cycles);
+	if (zpool.zeroed)
+		cprintf(" (%u per region)",
+			(uint32_t)(zpool.refill_cycles / zpool.zeroed));
+	cprintf("\n");
+}
+
+static void free_order(struct mem_region *r, int order)
+{
+	uint32_t idx = r - regions;
+
 	assert(r->refn == 0);
 	assert(r->next == NULL);
-	r->next = free_regions;
-	free_regions = r;
+	assert(!(r->flags & REGION_FREE));
+	assert((idx & ((1 << order) - 1)) == 0);
+
+	// coalesce with free buddies
+	while (order < REGION_MAX_ORDER) {
+		uint32_t buddy = idx ^ (1 << order);
+		struct mem_region *b;
+
+		if (buddy >= nregions)
+			break;
+		b = &regions[buddy];
+		if (!(b->flags & REGION_FREE) || b->order != order)
+			break;
+		free_area_remove(b);
+		idx &= ~(1 << order);
+		order++;
+	}
+	// whole top-order blocks are handed back to the extents
+	if (order == REGION_MAX_ORDER && extent_insert(idx, 1 << order))
+		return;
+	free_area_push(&regions[idx], order);
+}
+
+void region_free_order(struct mem_region *r, int order)
+{
+	ALLOCSTAT_BEGIN();
+
+	free_order(r, order);
+	ALLOCSTAT_END(AS_FREE);
+	TRACE(TR_FREE, region2pa(r), order);
+}
+
+void region_free(struct mem_region *r)
+{
+	ALLOCSTAT_BEGIN();
+
+	free_order(r, 0);
+	ALLOCSTAT_END(AS_FREE);
+	TRACE(TR_FREE, region2pa(r), 0);
 }
 
 void region_decref(struct mem_region* r)
 {
-	if (--r->refn == 0)
-		region_free(r);
+	if (--r->refn == 0) {
+		ALLOCSTAT_BEGIN();
+
+		free_order(r, 0);
+		ALLOCSTAT_END(AS_FREE);
+		TRACE(TR_FREE, region2pa(r), 0);
+	}
 }
 
-void mem_init()
+// Histogram of the maximal runs of free regions by log2 of their
+// length. Pooled zero regions count as in use.
+void region_free_runs(uint32_t hist[], int nbuckets, size_t *largest)
 {
-	region_init();
+	uint32_t i = 0, n, run = 0;
+	int e = 0;
+
+	memset(hist, 0, nbuckets * sizeof(hist[0]));
+	*largest = 0;
+	while (i <= nregions) {
+		if (e < nextents && extents[e].start == i)
+			n = extents[e++].len;
+		else if (i < nregions && (regions[i].flags & REGION_FREE))
+			n = 1 << regions[i].order;
+		else
+			n = 0;
+		if (n) {
+			run += n;
+			i += n;
+			continue;
+		}
+		if (run) {
+			hist[MIN(31 - __builtin_clz(run), nbuckets - 1)]++;
+			*largest = MAX(*largest, run);
+			run = 0;
+		}
+		i++;
+	}
+}
+
+void mem_init(physaddr_t bootparams)
+{
+	uint64_t memsize;
+	physaddr_t pa;
 
-	// map physical memory
-	for (uintptr_t addr = KERNBASE; addr != 0; addr += PTSIZE) {
-		kern_pgdir[PDX(addr)] = PADDR(addr) | PDE_ENTRY_1M | PDE_NONE_U;
-		kern_pgdir[PDX(PADDR(addr))] = 0;
+	if ((memsize = bootinfo_memsize(bootparams)) == 0) {
+		cprintf("No memory size from the bootloader, assuming %dM\n",
+			PHYS_MEM_MB);
+		memsize = (uint64_t)PHYS_MEM_MB * 1024 * 1024;
 	}
-	
-	// update console permission
-	kern_pgdir[PDX(MCONSOLE)] |= PDE_ENTRY_1M | PDE_NONE_U;
-	
-	// map kernel stack
-	kern_pgdir[PDX(KSTACKTOP - 1)] = PADDR(bootstack) | PDE_ENTRY_1M | PDE_NONE_U;
+	if (memsize > DIRECTMAP_MAX) {
+		cprintf("Only using %uM of %uM physical memory\n",
+			DIRECTMAP_MAX >> 20, (uint32_t)(memsize >> 20));
+		memsize = DIRECTMAP_MAX;
+	}
+	nregions = memsize / MEM_UNIT;
+	cprintf("Physical memory: %uK available\n", nregions * (MEM_UNIT / 1024));
+
+	// drop the identity mapping entry.S ran on
+	for (pa = 0; pa < 16 * PTSIZE; pa += PTSIZE)
+		kern_pgdir[PDX(pa)] = 0;
+
+	// cleared as it is handed out
+	regions = boot_alloc(nregions * sizeof(struct mem_region));
+	region_init();
+	directmap_fixup(nregions * MEM_UNIT);
+	map_kernel_image();
+	pte_sync(kern_pgdir, NPDENTRIES * sizeof(pde_t));
 	set_domain(0, DOMAIN_CLIENT);
+	// forget the boot mappings replaced above
+	tlb_flush_all();
 	
 	check_free_regions();
 	check_region_alloc();
 	check_region();
+	check_region_map();
+	check_region_cow();
 	check_kern_pgdir();
 	check_region_installed_pgdir();
+
+	tlb_init();
+}
+
+static void l2_partial_push(struct mem_region *rg)
+{
+	rg->prev = NULL;
+	rg->next = l2_partial;
+	if (l2_partial)
+		l2_partial->prev = rg;
+	l2_partial = rg;
+}
+
+static void l2_partial_remove(struct mem_region *rg)
+{
+	if (rg->prev)
+		rg->prev->next = rg->next;
+	else
+		l2_partial = rg->next;
+	if (rg->next)
+		rg->next->prev = rg->prev;
+	rg->next = rg->prev = NULL;
+}
+
+// Allocate a zeroed second-level page table, packing up to
+// L2_PER_REGION of them into one region. Free slots are kept zeroed.
+static pte_t *l2_alloc(void)
+{
+	struct mem_region *rg;
+	int slot;
+
+	if ((rg = l2_partial) == NULL) {
+		if ((rg = region_alloc(ALLOC_ZERO)) == NULL)
+			return NULL;
+		rg->refn++;
+		rg->flags |= REGION_L2;
+		rg->l2_used = 0;
+		l2_partial_push(rg);
+	}
+
+	for (slot = 0; rg->l2_used & (1 << slot); slot++)
+		/* do nothing */;
+	rg->l2_used |= 1 << slot;
+	if (rg->l2_used == (1 << L2_PER_REGION) - 1)
+		l2_partial_remove(rg);
+	// the walker must see it empty
+	pte_sync((void *)(region2kva(rg) + slot * L2_SIZE), L2_SIZE);
+	return (pte_t *)(region2kva(rg) + slot * L2_SIZE);
+}
+
+// Free a page table; its region goes back once every slot is free.
+static void l2_free(pte_t *pgtbl)
+{
+	struct mem_region *rg = pa2region(PADDR(pgtbl));
+	int slot = (PADDR(pgtbl) % MEM_UNIT) / L2_SIZE;
+
+	assert(rg->flags & REGION_L2);
+	assert(rg->l2_used & (1 << slot));
+
+	memset(pgtbl, 0, L2_SIZE);
+	if (rg->l2_used == (1 << L2_PER_REGION) - 1)
+		l2_partial_push(rg);
+	rg->l2_used &= ~(1 << slot);
+	if (rg->l2_used == 0) {
+		l2_partial_remove(rg);
+		rg->flags &= ~REGION_L2;
+		region_decref(rg);
+	}
+}
+
+// Unhook and free the page table covering va, once no cached walk can
+// lead to it.
+static void pgdir_free_table(pde_t *pgdir, uintptr_t va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	pte_t *pgtbl = (pte_t *)KADDR(PDE_ADDR(*pde));
+
+	assert((*pde & PDE_P) == PDE_ENTRY);
+	*pde = 0;
+	pte_sync(pde, sizeof(*pde));
+	tlb_invalidate(pgdir, va);
+	l2_free(pgtbl);
 }
 
 pte_t * pgdir_walk(pde_t *pgdir, uintptr_t va, bool create)
 {
+	pte_t *pte = NULL;
+	ALLOCSTAT_BEGIN();
+
 	pde_t *pde = &pgdir[PDX(va)];
-	if (!(*pde & 3)) {
+	if ((*pde & PDE_P) == PDE_ENTRY_1M) {
+	    // a section: there is no page table
+	    goto out;
+	}
+	if (!(*pde & PDE_P)) {
 	    if (!create) {
-	        return NULL;
+	        goto out;
 	    }
-	    struct mem_region *new = region_alloc(ALLOC_ZERO);
+	    pte_t *new = l2_alloc();
 	    if (new == NULL) {
-	        return NULL;
+	        goto out;
 	    }
-	    new->refn++;
-	    *pde = region2pa(new) | PDE_ENTRY;
+	    *pde = PADDR(new) | PDE_ENTRY;
+	    pte_sync(pde, sizeof(*pde));
 	}
 	
 	pte_t *pgtbl = (pte_t *)KADDR(PDE_ADDR(*pde));
-	return &pgtbl[PTX(va)];
+	pte = &pgtbl[PTX(va)];
+out:
+	ALLOCSTAT_END(AS_WALK);
+	TRACE(TR_WALK, va, create);
+	return pte;
 }
 
-static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa)
+// Descriptor attributes (everything but the address and the type) are
+// passed around in small-page layout: XN, B, C, AP, TEX, APX, S, nG.
+// These convert them to and from the large-page and section layouts.
+static inline uint32_t attr_small2large(uint32_t a)
 {
-	assert(va % PGSIZE == 0);
-	assert(pa % PGSIZE == 0);
-    for (uintptr_t off = 0; off < size; off += PGSIZE) {
-        pte_t *pte = pgdir_walk(pgdir, off + va, true);
-        if (pte == NULL) {
-            panic("boot_map_region out of memory\n");
-        }
-        *pte = (pa + off) | PTE_ENTRY_SMALL | PTE_NONE_U;
-    }
+	return (a & 0xe3c) | ((a & 0x1c0) << 6) | ((a & 0x1) << 15);
 }
 
-uintptr_t mmio_map_region(physaddr_t pa, size_t size)
+static inline uint32_t attr_large2small(uint32_t a)
+{
+	return (a & 0xe3c) | ((a >> 6) & 0x1c0) | ((a >> 15) & 0x1);
+}
+
+static inline uint32_t attr_small2sect(uint32_t a)
+{
+	return (a & 0xc) | ((a & 0x1) << 4) | ((a & 0xff0) << 6);
+}
+
+static inline uint32_t attr_sect2small(uint32_t a)
+{
+	return (a & 0xc) | ((a >> 4) & 0x1) | ((a >> 6) & 0xff0);
+}
+
+static inline bool pde_is_super(pde_t pde)
+{
+	return (pde & PDE_ENTRY_16M) == PDE_ENTRY_16M;
+}
+
+static inline bool pde_is_sect(pde_t pde)
+{
+	return (pde & PDE_P) == PDE_ENTRY_1M && !pde_is_super(pde);
+}
+
+// Physical address va translates to, or ~0. If the mapping is a page,
+// its PTE is stored in *pte_store; for sections that is NULL.
+static physaddr_t va2pa(pde_t *pgdir, uintptr_t va, pte_t **pte_store)
+{
+	pde_t pde = pgdir[PDX(va)];
+	pte_t *pte = NULL;
+	physaddr_t pa;
+
+	if (pde_is_super(pde))
+		pa = (pde & ~(SSECTSIZE - 1)) | (va & (SSECTSIZE - 1));
+	else if (pde_is_sect(pde))
+		pa = (pde & ~(PTSIZE - 1)) | (va & (PTSIZE - 1));
+	else if ((pte = pgdir_walk(pgdir, va, 0)) == NULL || !(*pte & PTE_P))
+		return ~0;
+	else if ((*pte & PTE_P) == PTE_ENTRY_LARGE)
+		pa = PTE_LARGE_ADDR(*pte) | (va & (LPGSIZE - 1));
+	else
+		pa = PTE_SMALL_ADDR(*pte) | (va & (PGSIZE - 1));
+	if (pte_store)
+		*pte_store = pte;
+	return pa;
+}
+
+// Attributes of the mapping of va, in small-page layout, or 0 if
+// there is none.
+static uint32_t va_attr(pde_t *pgdir, uintptr_t va)
+{
+	pde_t pde = pgdir[PDX(va)];
+	pte_t *pte;
+
+	if ((pde & PDE_P) == PDE_ENTRY_1M)
+		return attr_sect2small(pde);
+	if ((pte = pgdir_walk(pgdir, va, 0)) == NULL || !(*pte & PTE_P))
+		return 0;
+	if ((*pte & PTE_P) == PTE_ENTRY_LARGE)
+		return attr_large2small(*pte);
+	return *pte & PTE_ATTR;
+}
+
+// Add delta to the references a mapping of [pa, pa + size) holds: one
+// per 4KiB page of RAM, added a region at a time. Device memory is not
+// counted.
+static void ref_range(physaddr_t pa, size_t size, int delta)
+{
+	physaddr_t end, next;
+
+	if (pa >= nregions * MEM_UNIT)
+		return;
+	end = pa + MIN(size, nregions * MEM_UNIT - pa);
+	for (; pa < end; pa = next) {
+		next = MIN(ROUNDDOWN(pa, MEM_UNIT) + MEM_UNIT, end);
+		pa2region(pa)->refn += delta * (int)((next - pa) / PGSIZE);
+	}
+}
+
+// Free n regions from idx in the largest aligned buddy blocks.
+static void free_run(uint32_t idx, uint32_t n)
+{
+	ALLOCSTAT_BEGIN();
+
+	while (n > 0) {
+		int o = MIN(31 - __builtin_clz(n), REGION_MAX_ORDER);
+
+		if (idx)
+			o = MIN(o, __builtin_ctz(idx));
+		free_order(&regions[idx], o);
+		idx += 1 << o;
+		n -= 1 << o;
+	}
+	ALLOCSTAT_END(AS_FREE);
+}
+
+// Drop those references. Runs of regions that are no longer used are
+// freed together.
+static void unref_range(physaddr_t pa, size_t size)
+{
+	physaddr_t end, next;
+	uint32_t first = 0, n = 0;
+	struct mem_region *r;
+
+	if (pa >= nregions * MEM_UNIT)
+		return;
+	end = pa + MIN(size, nregions * MEM_UNIT - pa);
+	for (; pa < end; pa = next) {
+		next = MIN(ROUNDDOWN(pa, MEM_UNIT) + MEM_UNIT, end);
+		r = pa2region(pa);
+		r->refn -= (int)((next - pa) / PGSIZE);
+		assert(r->refn >= 0);
+		if (r->refn > 0)
+			continue;
+		if (n > 0 && first + n != r - regions) {
+			free_run(first, n);
+			n = 0;
+		}
+		if (n++ == 0)
+			first = r - regions;
+	}
+	if (n > 0)
+		free_run(first, n);
+}
+
+// Drop the references of memory whose mappings were removed once tlb
+// is flushed. Physically contiguous memory is dropped in one go.
+static void unref_add(struct tlb_gather *tlb, physaddr_t pa, size_t size)
+{
+	int i = tlb->nruns - 1;
+
+	if (i >= 0 && tlb->runs[i].pa + tlb->runs[i].size == pa) {
+		tlb->runs[i].size += size;
+		return;
+	}
+	if (tlb->nruns == TLB_GATHER_FREE)
+		tlb_gather_flush(tlb);
+	tlb->runs[tlb->nruns].pa = pa;
+	tlb->runs[tlb->nruns].size = size;
+	tlb->nruns++;
+}
+
+// Unhook the page table covering va; it is freed once tlb is flushed.
+static void unhook_table(pde_t *pgdir, uintptr_t va, struct tlb_gather *tlb)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+
+	assert((*pde & PDE_P) == PDE_ENTRY);
+	if (tlb->ntables == TLB_GATHER_FREE)
+		tlb_gather_flush(tlb);
+	tlb->tables[tlb->ntables++] = (pte_t *)KADDR(PDE_ADDR(*pde));
+	*pde = 0;
+	pte_sync(pde, sizeof(*pde));
+	tlb_gather_add(tlb, va);
+}
+
+void region_gather_release(struct tlb_gather *tlb)
+{
+	int i;
+
+	for (i = 0; i < tlb->ntables; i++)
+		l2_free(tlb->tables[i]);
+	for (i = 0; i < tlb->nruns; i++)
+		unref_range(tlb->runs[i].pa, tlb->runs[i].size);
+	tlb->ntables = 0;
+	tlb->nruns = 0;
+}
+
+// Replace the supersection covering va by 16 sections.
+static void split_super(pde_t *pgdir, uintptr_t va)
 {
-	static uintptr_t base = MMIOBASE;
-	size = ROUNDUP(size, PGSIZE);
-	if (base + size > MMIOLIM)
+	pde_t *pde = &pgdir[PDX(ROUNDDOWN(va, SSECTSIZE))];
+	physaddr_t pa = *pde & ~(SSECTSIZE - 1);
+	uint32_t attr = attr_small2sect(attr_sect2small(*pde));
+	int i;
+
+	// break before make, so the TLB never holds both sizes
+	memset(pde, 0, 16 * sizeof(pde_t));
+	pte_sync(pde, 16 * sizeof(pde_t));
+	tlb_invalidate(pgdir, va);
+	for (i = 0; i < 16; i++)
+		pde[i] = (pa + i * PTSIZE) | PDE_ENTRY_1M | attr;
+	pte_sync(pde, 16 * sizeof(pde_t));
+}
+
+// Replace the section covering va by a page table of large pages.
+static int split_sect(pde_t *pgdir, uintptr_t va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	physaddr_t pa = *pde & ~(PTSIZE - 1);
+	uint32_t attr = attr_small2large(attr_sect2small(*pde));
+	pte_t *pgtbl;
+	int i;
+
+	if ((pgtbl = l2_alloc()) == NULL)
 		return -E_NO_MEM;
+	for (i = 0; i < NPTENTRIES; i++)
+		pgtbl[i] = (pa + ROUNDDOWN(i * PGSIZE, LPGSIZE)) |
+			PTE_ENTRY_LARGE | attr;
+	pte_sync(pgtbl, L2_SIZE);
+	*pde = 0;
+	pte_sync(pde, sizeof(*pde));
+	tlb_invalidate(pgdir, va);
+	*pde = PADDR(pgtbl) | PDE_ENTRY;
+	pte_sync(pde, sizeof(*pde));
+	return 0;
+}
 
-	boot_map_region(kern_pgdir, base, size, pa);
-	uintptr_t old_base = base;
-	base += size;
-	return old_base;
+// Replace the large page covering va by 16 small pages.
+static void split_large(pde_t *pgdir, uintptr_t va, pte_t *pte)
+{
+	pte_t *first = pte - PTX(va) % 16;
+	physaddr_t pa = PTE_LARGE_ADDR(*first);
+	uint32_t attr = attr_large2small(*first);
+	int i;
+
+	memset(first, 0, 16 * sizeof(pte_t));
+	pte_sync(first, 16 * sizeof(pte_t));
+	tlb_invalidate(pgdir, va);
+	for (i = 0; i < 16; i++)
+		first[i] = (pa + i * PGSIZE) | PTE_ENTRY_SMALL | attr;
+	pte_sync(first, 16 * sizeof(pte_t));
 }
 
-struct mem_region* 
-region_lookup(pde_t *pgdir, uintptr_t va, pte_t **pte_store)
+// Clear the PTEs mapping [va, va + size), which lie in one page table,
+// in a single pass. A large page straddling either end is split first.
+// The references of the memory unmapped go with tlb if putref is set.
+static void clear_ptes(pde_t *pgdir, uintptr_t va, size_t size,
+		       bool putref, struct tlb_gather *tlb)
 {
-	pte_t* ppte = pgdir_walk(pgdir, va, 0);
-	if (NULL == ppte) {
-		return NULL;
+	pte_t *start = (pte_t *)KADDR(PDE_ADDR(pgdir[PDX(va)])) + PTX(va);
+	pte_t *pte = start;
+	physaddr_t pa;
+	size_t step;
+
+	for (; size; va += step, size -= step, pte += step / PGSIZE) {
+		step = PGSIZE;
+		if (!(*pte & PTE_P))
+			continue;
+		if ((*pte & PTE_P) == PTE_ENTRY_LARGE &&
+		    (va % LPGSIZE || size < LPGSIZE))
+			split_large(pgdir, va, pte);
+		if ((*pte & PTE_P) == PTE_ENTRY_LARGE) {
+			pa = PTE_LARGE_ADDR(*pte);
+			step = LPGSIZE;
+			memset(pte, 0, 16 * sizeof(pte_t));
+		} else {
+			pa = PTE_SMALL_ADDR(*pte);
+			*pte = 0;
+		}
+		tlb_gather_add(tlb, va);
+		if (putref)
+			unref_add(tlb, pa, step);
 	}
-	if (!(*ppte & PTE_P)) {
-	    return NULL;
+	pte_sync(start, (pte - start) * sizeof(pte_t));
+}
+
+// Remove whatever is mapped in [va, va + size), splitting larger
+// mappings that straddle the ends. Each page table is visited once,
+// and those the range covers entirely are unhooked. The TLB
+// invalidations are left in 'tlb', which also holds on to the page
+// tables and, if putref is set, the references of the memory unmapped:
+// they are only released when it is flushed, so nothing reuses them
+// while the TLB can still reach them. Fails only if a section had to
+// be split and no page table could be allocated.
+static int unmap_range(pde_t *pgdir, uintptr_t va, size_t size, bool putref,
+		       struct tlb_gather *tlb)
+{
+	pde_t *pde;
+	size_t step;
+	int r = 0;
+
+	while (size) {
+		pde = &pgdir[PDX(va)];
+		if (pde_is_super(*pde)) {
+			if (va % SSECTSIZE || size < SSECTSIZE) {
+				split_super(pgdir, va);
+				continue;
+			}
+			step = SSECTSIZE;
+			if (putref)
+				unref_add(tlb, *pde & ~(SSECTSIZE - 1), step);
+			memset(pde, 0, 16 * sizeof(pde_t));
+			pte_sync(pde, 16 * sizeof(pde_t));
+			tlb_gather_add(tlb, va);
+		} else if (pde_is_sect(*pde)) {
+			if (va % PTSIZE || size < PTSIZE) {
+				if ((r = split_sect(pgdir, va)) < 0)
+					break;
+				continue;
+			}
+			step = PTSIZE;
+			if (putref)
+				unref_add(tlb, *pde & ~(PTSIZE - 1), step);
+			*pde = 0;
+			pte_sync(pde, sizeof(*pde));
+			tlb_gather_add(tlb, va);
+		} else if (!(*pde & PDE_P)) {
+			step = MIN(PTSIZE - va % PTSIZE, size);
+		} else {
+			step = MIN(PTSIZE - va % PTSIZE, size);
+			clear_ptes(pgdir, va, step, putref, tlb);
+			if (step == PTSIZE)
+				unhook_table(pgdir, va, tlb);
+		}
+		va += step;
+		size -= step;
 	}
-	struct mem_region* rg = pa2region(*ppte);
-	if (pte_store) {
-		*pte_store = ppte;
+	return r;
+}
+
+// Make the n L1 entries from va available for a section mapping,
+// freeing page tables there that map nothing.
+static bool l1_reclaim(pde_t *pgdir, uintptr_t va, int n)
+{
+	pte_t *pgtbl;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		pde_t pde = pgdir[PDX(va) + i];
+		if (pde == 0)
+			continue;
+		if ((pde & PDE_P) != PDE_ENTRY)
+			return false;
+		pgtbl = (pte_t *)KADDR(PDE_ADDR(pde));
+		for (j = 0; j < NPTENTRIES; j++)
+			if (pgtbl[j] & PTE_P)
+				return false;
 	}
-	return rg;
+	for (i = 0; i < n; i++)
+		if (pgdir[PDX(va) + i])
+			pgdir_free_table(pgdir, va + i * PTSIZE);
+	return true;
 }
 
-int
-region_insert(pde_t *pgdir, struct mem_region *rg, uintptr_t va, int perm)
+// Fill the PTEs from pte so they map [va, va + size) to pa, using large
+// pages wherever the alignment of both allows. The range lies in one
+// page table.
+static void fill_ptes(pte_t *pte, uintptr_t va, physaddr_t pa, size_t size,
+		      int perm)
+{
+	uint32_t lattr = attr_small2large(perm);
+	pte_t *start = pte;
+	size_t off = 0;
+	int i;
+
+	while (off < size) {
+		if ((va + off) % LPGSIZE == 0 && (pa + off) % LPGSIZE == 0 &&
+		    size - off >= LPGSIZE) {
+			for (i = 0; i < 16; i++)
+				*pte++ = (pa + off) | PTE_ENTRY_LARGE | lattr;
+			off += LPGSIZE;
+		} else {
+			*pte++ = (pa + off) | PTE_ENTRY_SMALL | perm;
+			off += PGSIZE;
+		}
+	}
+	pte_sync(start, (pte - start) * sizeof(pte_t));
+}
+
+// Map [va, va + size) to [pa, pa + size) with the largest pages the
+// alignment of both allows. The range must be unmapped.
+static int map_range(pde_t *pgdir, uintptr_t va, physaddr_t pa, size_t size,
+		     int perm)
+{
+	pte_t *pte;
+	size_t step;
+	int i;
+
+	assert(va % PGSIZE == 0 && pa % PGSIZE == 0 && size % PGSIZE == 0);
+	while (size) {
+		if (va % SSECTSIZE == 0 && pa % SSECTSIZE == 0 &&
+		    size >= SSECTSIZE && l1_reclaim(pgdir, va, 16)) {
+			for (i = 0; i < 16; i++)
+				pgdir[PDX(va) + i] = pa | PDE_ENTRY_16M |
+					attr_small2sect(perm);
+			pte_sync(&pgdir[PDX(va)], 16 * sizeof(pde_t));
+			step = SSECTSIZE;
+		} else if (va % PTSIZE == 0 && pa % PTSIZE == 0 &&
+			   size >= PTSIZE && l1_reclaim(pgdir, va, 1)) {
+			pgdir[PDX(va)] = pa | PDE_ENTRY_1M | attr_small2sect(perm);
+			pte_sync(&pgdir[PDX(va)], sizeof(pde_t));
+			step = PTSIZE;
+		} else if ((pte = pgdir_walk(pgdir, va, 1)) == NULL) {
+			return -E_NO_MEM;
+		} else {
+			// the rest of this page table in one pass
+			step = MIN(PTSIZE - va % PTSIZE, size);
+			fill_ptes(pte, va, pa, step, perm);
+		}
+		va += step;
+		pa += step;
+		size -= step;
+	}
+	// make the new entries visible to the table walker
+	dsb();
+	isb();
+	return 0;
+}
+
+// How the kernel image is mapped, page by page: text read-only,
+// read-only data also no-execute, and the rest read-write and
+// no-execute. All of it is global, so its TLB entries survive address
+// space switches.
+static uint32_t kernel_page_perm(uintptr_t va)
+{
+	extern char _start[], etext[], erodata[];
+
+	if (va >= ROUNDDOWN((uintptr_t)_start, PGSIZE) && va < (uintptr_t)etext)
+		return PTE_RO_NONE_U | PTE_MEM_NORMAL;
+	if (va >= (uintptr_t)etext && va < (uintptr_t)erodata)
+		return PTE_RO_NONE_U | PTE_MEM_NORMAL | PTE_XN;
+	return PTE_NONE_U | PTE_MEM_NORMAL | PTE_XN;
+}
+
+// Replace the sections holding the kernel text and read-only data by
+// page tables following kernel_page_perm. Each table is filled in
+// before it replaces its section, since this code runs from one.
+static void map_kernel_image(void)
+{
+	extern char _start[], erodata[];
+	uintptr_t va;
+	pte_t *pgtbl;
+	uint32_t perm;
+	int i, j;
+
+	for (va = ROUNDDOWN((uintptr_t)_start, PTSIZE);
+	     va < (uintptr_t)erodata; va += PTSIZE) {
+		if ((pgtbl = l2_alloc()) == NULL)
+			panic("map_kernel_image: out of memory");
+		for (i = 0; i < NPTENTRIES; i = j) {
+			perm = kernel_page_perm(va + i * PGSIZE);
+			for (j = i + 1; j < NPTENTRIES &&
+			     kernel_page_perm(va + j * PGSIZE) == perm; j++)
+				/* do nothing */;
+			fill_ptes(&pgtbl[i], va + i * PGSIZE,
+				  PADDR(va + i * PGSIZE), (j - i) * PGSIZE, perm);
+		}
+		kern_pgdir[PDX(va)] = PADDR(pgtbl) | PDE_ENTRY;
+	}
+	// the sections around the image were left executable for boot
+	for (va = KERNBASE; va < KERNBASE + SSECTSIZE; va += PTSIZE)
+		if (pde_is_sect(kern_pgdir[PDX(va)]))
+			kern_pgdir[PDX(va)] |= PDE_XN;
+}
+
+// The boot page table maps boot_directmap_size of RAM at KERNBASE, the
+// configured amount. Map physical memory, and only that, if the
+// bootloader found a different amount.
+static void directmap_fixup(physaddr_t memsize)
+{
+	struct tlb_gather tlb;
+
+	if (memsize > boot_directmap_size &&
+	    map_range(kern_pgdir, KADDR(boot_directmap_size),
+		      boot_directmap_size, memsize - boot_directmap_size,
+		      PTE_NONE_U | PTE_MEM_NORMAL | PTE_XN) < 0)
+		panic("directmap_fixup: out of memory");
+	if (memsize < boot_directmap_size) {
+		tlb_gather_init(&tlb, kern_pgdir);
+		if (unmap_range(kern_pgdir, KADDR(memsize),
+				boot_directmap_size - memsize, false, &tlb) < 0)
+			panic("directmap_fixup: out of memory");
+		tlb_gather_flush(&tlb);
+	}
+}
+
+// Device windows mapped in [MMIOBASE, MMIOLIM), sorted by va. A device
+// mapped again inside a live window of the same memory type shares it.
+#define MMIO_MAX 32
+static struct mmio_window {
+	uintptr_t va;
+	physaddr_t pa;
+	size_t size;
+	int memtype;
+	int refs;
+} mmio[MMIO_MAX];
+static int nmmio;
+
+// Find room for [pa, pa + size) in the MMIO area, at a va as aligned
+// as pa for the largest mapping size can use, so big windows get
+// sections and large pages. Returns the index to insert it at, or -1.
+static int mmio_va_alloc(physaddr_t pa, size_t size, uintptr_t *va_store)
+{
+	size_t align = size >= PTSIZE ? PTSIZE :
+		size >= LPGSIZE ? LPGSIZE : PGSIZE;
+	uintptr_t lo = MMIOBASE, hi, va;
+	int i;
+
+	for (i = 0; i <= nmmio; i++) {
+		hi = i < nmmio ? mmio[i].va : MMIOLIM;
+		va = ROUNDDOWN(lo, align) + pa % align;
+		if (va < lo)
+			va += align;
+		if (va < hi && size <= hi - va) {
+			*va_store = va;
+			return i;
+		}
+		if (i < nmmio)
+			lo = mmio[i].va + mmio[i].size;
+	}
+	return -1;
+}
+
+// Map device memory [pa, pa + size) into the kernel, uncached and
+// never executable, as PTE_MEM_DEVICE or PTE_MEM_SO. Returns the
+// virtual address of pa, or -E_NO_MEM.
+uintptr_t mmio_map_attr(physaddr_t pa, size_t size, int memtype)
 {
-	// Fill this function in
-	pte_t* ppte = pgdir_walk(pgdir, va, 1);
-	if (NULL == ppte) {
+	struct tlb_gather tlb;
+	physaddr_t off = PGOFF(pa);
+	uintptr_t va;
+	int i;
+
+	assert(memtype == PTE_MEM_DEVICE || memtype == PTE_MEM_SO);
+	pa -= off;
+	size = ROUNDUP(size + off, PGSIZE);
+	for (i = 0; i < nmmio; i++)
+		if (mmio[i].memtype == memtype && pa >= mmio[i].pa &&
+		    pa + size <= mmio[i].pa + mmio[i].size) {
+			mmio[i].refs++;
+			return mmio[i].va + (pa - mmio[i].pa) + off;
+		}
+
+	if (nmmio == MMIO_MAX || (i = mmio_va_alloc(pa, size, &va)) < 0)
+		return -E_NO_MEM;
+	if (map_range(kern_pgdir, va, pa, size,
+		      PTE_NONE_U | memtype | PTE_XN) < 0) {
+		tlb_gather_init(&tlb, kern_pgdir);
+		unmap_range(kern_pgdir, va, size, false, &tlb);
+		tlb_gather_flush(&tlb);
 		return -E_NO_MEM;
 	}
-	rg->refn ++;
-	if (*ppte & PTE_P) {
-		region_remove(pgdir, va);
+	memmove(&mmio[i + 1], &mmio[i], (nmmio - i) * sizeof(mmio[0]));
+	mmio[i].va = va;
+	mmio[i].pa = pa;
+	mmio[i].size = size;
+	mmio[i].memtype = memtype;
+	mmio[i].refs = 1;
+	nmmio++;
+	return va + off;
+}
+
+uintptr_t mmio_map_region(physaddr_t pa, size_t size)
+{
+	return mmio_map_attr(pa, size, PTE_MEM_DEVICE);
+}
+
+// Drop a reference on the window holding va, from mmio_map_*. The last
+// one unmaps it and frees its address space for reuse.
+int mmio_unmap_region(uintptr_t va)
+{
+	struct tlb_gather tlb;
+	int i;
+
+	for (i = 0; i < nmmio; i++)
+		if (va >= mmio[i].va && va - mmio[i].va < mmio[i].size)
+			break;
+	if (i == nmmio)
+		return -E_INVAL;
+	if (--mmio[i].refs > 0)
+		return 0;
+
+	// nothing here is RAM, and tables only held device pages
+	tlb_gather_init(&tlb, kern_pgdir);
+	if (unmap_range(kern_pgdir, mmio[i].va, mmio[i].size, false, &tlb) < 0)
+		panic("mmio_unmap_region: cannot split a section");
+	tlb_gather_flush(&tlb);
+	memmove(&mmio[i], &mmio[i + 1], (nmmio - i - 1) * sizeof(mmio[0]));
+	nmmio--;
+	return 0;
+}
+
+// The attributes a mapping of va in pgdir gets for the perm passed to
+// the range functions.
+static int range_perm(pde_t *pgdir, uintptr_t va, int perm)
+{
+	// user mappings of other address spaces are tagged with their ASID
+	if (pgdir != kern_pgdir && va < ULIM)
+		perm |= PTE_NG;
+	// and nothing the kernel maps for itself is code
+	if (va >= ULIM)
+		perm |= PTE_XN;
+	if (perm & PERM_MEM_SO)
+		perm = (perm & ~(PERM_MEM_SO | PTE_MEM_MASK)) | PTE_MEM_SO;
+	else if (!(perm & PTE_MEM_MASK))
+		perm |= PTE_MEM_NORMAL;
+	return perm;
+}
+
+// Map [va, va + size) to [pa, pa + size), replacing whatever was
+// there. Pages of RAM mapped hold a reference on their region.
+static int insert_range(pde_t *pgdir, uintptr_t va, physaddr_t pa,
+			size_t size, int perm)
+{
+	struct tlb_gather tlb;
+	int r;
+
+	assert(va % PGSIZE == 0 && size % PGSIZE == 0);
+	perm = range_perm(pgdir, va, perm);
+	tlb_gather_init(&tlb, pgdir);
+	// take the new references first: pa may already be mapped here
+	ref_range(pa, size, 1);
+	r = unmap_range(pgdir, va, size, true, &tlb);
+	// the old entries must be gone before new ones of another size
+	// can be loaded
+	tlb_gather_flush(&tlb);
+	if (r == 0 && (r = map_range(pgdir, va, pa, size, perm)) < 0) {
+		unmap_range(pgdir, va, size, false, &tlb);
+		tlb_gather_flush(&tlb);
+	}
+	if (r < 0)
+		ref_range(pa, size, -1);
+	return r;
+}
+
+// Map 'size' bytes of the physically contiguous regions starting at
+// 'rg' at 'va', replacing whatever was there. 64KiB pages, 1MiB
+// sections and 16MiB supersections are used wherever the alignment of
+// both addresses allows. Every 4KiB page mapped holds a reference on
+// its region. Each page table is visited once and the TLB is flushed
+// once. The memory is mapped write-back cacheable unless perm asks for
+// another type, with PERM_MEM_SO for strongly-ordered. On failure
+// nothing new is mapped.
+int region_insert_range(pde_t *pgdir, struct mem_region *rg, uintptr_t va,
+			size_t size, int perm)
+{
+	TRACE(TR_INSERT, va, size);
+	return insert_range(pgdir, va, region2pa(rg), size, perm);
+}
+
+// Unmap [va, va + size), dropping the references the pages held.
+int region_remove_range(pde_t *pgdir, uintptr_t va, size_t size)
+{
+	struct tlb_gather tlb;
+	int r;
+
+	assert(va % PGSIZE == 0 && size % PGSIZE == 0);
+	TRACE(TR_REMOVE, va, size);
+	tlb_gather_init(&tlb, pgdir);
+	r = unmap_range(pgdir, va, size, true, &tlb);
+	tlb_gather_flush(&tlb);
+	return r;
+}
+
+// Back [va, va + size) with newly allocated zeroed memory, replacing
+// whatever was there. Memory is taken in the largest blocks the
+// alignment of va allows, so it can be mapped with large pages and
+// sections; smaller ones are used when those run out. On failure
+// nothing new is mapped.
+int region_populate_range(pde_t *pgdir, uintptr_t va, size_t size, int perm)
+{
+	struct mem_region *rg;
+	struct tlb_gather tlb;
+	physaddr_t pa;
+	size_t done, step;
+	int order, r;
+
+	assert(va % PGSIZE == 0 && size % PGSIZE == 0);
+	perm = range_perm(pgdir, va, perm);
+	tlb_gather_init(&tlb, pgdir);
+	r = unmap_range(pgdir, va, size, true, &tlb);
+	tlb_gather_flush(&tlb);
+
+	for (done = 0; r == 0 && done < size; done += step) {
+		for (order = REGION_MAX_ORDER; order > 0; order--)
+			if ((va + done) % (MEM_UNIT << order) == 0 &&
+			    size - done >= (MEM_UNIT << order))
+				break;
+		while ((rg = region_alloc_order(order, ALLOC_ZERO)) == NULL &&
+		       order > 0)
+			order--;
+		if (rg == NULL) {
+			r = -E_NO_MEM;
+			break;
+		}
+		pa = region2pa(rg);
+		step = MIN(size - done, (size_t)MEM_UNIT << order);
+		ref_range(pa, step, 1);
+		if ((r = map_range(pgdir, va + done, pa, step, perm)) < 0) {
+			unmap_range(pgdir, va + done, step, false, &tlb);
+			unref_add(&tlb, pa, step);
+		}
 	}
-	*ppte = region2pa(rg) | PTE_ENTRY_SMALL | perm;
-	
-	tlb_invalidate(pgdir, va);
-	
+	if (r < 0)
+		unmap_range(pgdir, va, done, true, &tlb);
+	tlb_gather_flush(&tlb);
+	return r;
+}
+
+// Anonymous memory reserved with region_reserve. Nothing is allocated
+// for it until a page is touched; then region_anon_fault maps a zeroed
+// region there.
+struct anon_range {
+	pde_t *pgdir;
+	uintptr_t start, end;
+	int perm;
+	struct anon_range *next;
+};
+
+static struct anon_range *anon_ranges;
+
+static struct anon_range *anon_lookup(pde_t *pgdir, uintptr_t va)
+{
+	struct anon_range *ar;
+
+	for (ar = anon_ranges; ar; ar = ar->next)
+		if (ar->pgdir == pgdir && ar->start <= va && va < ar->end)
+			return ar;
+	return NULL;
+}
+
+// Reserve [va, va + size) in pgdir for anonymous memory mapped with
+// perm. Fails if part of it is already reserved.
+int region_reserve(pde_t *pgdir, uintptr_t va, size_t size, int perm)
+{
+	struct anon_range *ar;
+
+	assert(va % PGSIZE == 0 && size % PGSIZE == 0 && va + size > va);
+	for (ar = anon_ranges; ar; ar = ar->next)
+		if (ar->pgdir == pgdir && ar->start < va + size && va < ar->end)
+			return -E_INVAL;
+	if ((ar = kmalloc(sizeof(*ar))) == NULL)
+		return -E_NO_MEM;
+	ar->pgdir = pgdir;
+	ar->start = va;
+	ar->end = va + size;
+	ar->perm = perm;
+	ar->next = anon_ranges;
+	anon_ranges = ar;
 	return 0;
 }
 
-void
-region_remove(pde_t *pgdir, uintptr_t va)
+// Drop the reservations in [va, va + size) and unmap whatever of them
+// was touched.
+int region_unreserve(pde_t *pgdir, uintptr_t va, size_t size)
 {
-	// Fill this function in
-	pte_t* ppte;
-	struct mem_region* rg = region_lookup(pgdir, va, &ppte);
-	if (NULL == rg) {
-		return;
+	struct anon_range **pp, *ar, *tail;
+	uintptr_t end = va + size;
+
+	assert(va % PGSIZE == 0 && size % PGSIZE == 0 && end > va);
+	for (pp = &anon_ranges; (ar = *pp) != NULL; ) {
+		if (ar->pgdir != pgdir || ar->end <= va || ar->start >= end) {
+			pp = &ar->next;
+		} else if (ar->start >= va && ar->end <= end) {
+			*pp = ar->next;
+			kfree(ar);
+		} else if (ar->start < va && ar->end > end) {
+			// a hole in the middle
+			if ((tail = kmalloc(sizeof(*tail))) == NULL)
+				return -E_NO_MEM;
+			*tail = *ar;
+			tail->start = end;
+			ar->end = va;
+			ar->next = tail;
+			pp = &tail->next;
+		} else {
+			if (ar->start < va)
+				ar->end = va;
+			else
+				ar->start = end;
+			pp = &ar->next;
+		}
+	}
+	return region_remove_range(pgdir, va, size);
+}
+
+// Back the page at va with a zeroed region if it is reserved and not
+// mapped yet. The rest of the region around va is mapped along with it,
+// within the reservation, unless some of that is mapped already.
+// Returns -E_FAULT if va isn't reserved.
+int region_anon_fault(pde_t *pgdir, uintptr_t va)
+{
+	struct anon_range *ar;
+	struct mem_region *rg;
+	uintptr_t lo, hi, v;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((ar = anon_lookup(pgdir, va)) == NULL ||
+	    va2pa(pgdir, va, NULL) != ~0)
+		return -E_FAULT;
+	lo = ROUNDDOWN(va, MEM_UNIT);
+	hi = lo + MIN((uintptr_t)MEM_UNIT, ar->end - lo);
+	lo = MAX(lo, ar->start);
+	for (v = lo; v < hi; v += PGSIZE)
+		if (va2pa(pgdir, v, NULL) != ~0) {
+			lo = va;
+			hi = va + PGSIZE;
+			break;
+		}
+	if ((rg = region_alloc(ALLOC_ZERO)) == NULL)
+		return -E_NO_MEM;
+	r = insert_range(pgdir, lo, region2pa(rg) + lo % MEM_UNIT, hi - lo,
+			 ar->perm);
+	if (rg->refn == 0)
+		region_free(rg);
+	return r;
+}
+
+// Forget the reservations of a dying address space.
+static void anon_drop(pde_t *pgdir)
+{
+	struct anon_range **pp, *ar;
+
+	for (pp = &anon_ranges; (ar = *pp) != NULL; )
+		if (ar->pgdir == pgdir) {
+			*pp = ar->next;
+			kfree(ar);
+		} else {
+			pp = &ar->next;
+		}
+}
+
+// Give dst the reservations src has in its user half.
+static int anon_clone(pde_t *dst, pde_t *src)
+{
+	struct anon_range *ar, *copy;
+
+	for (ar = anon_ranges; ar; ar = ar->next) {
+		if (ar->pgdir != src || ar->start >= ULIM)
+			continue;
+		if ((copy = kmalloc(sizeof(*copy))) == NULL)
+			return -E_NO_MEM;
+		*copy = *ar;
+		copy->pgdir = dst;
+		copy->end = MIN(copy->end, (uintptr_t)ULIM);
+		copy->next = anon_ranges;
+		anon_ranges = copy;
 	}
+	return 0;
+}
+
+// Create an address space: the kernel half is shared with kern_pgdir,
+// the user half is empty. Later changes to kern_pgdir above ULIM that
+// add first-level entries are not seen by it.
+pde_t *pgdir_create(void)
+{
+	struct mem_region *rg;
+	pde_t *pgdir;
+
+	if ((rg = region_alloc(ALLOC_ZERO)) == NULL)
+		return NULL;
+	rg->refn++;
+	rg->flags |= REGION_PGDIR;
+	rg->asid = 0;
+	pgdir = (pde_t *)region2kva(rg);
+	memcpy(&pgdir[PDX(ULIM)], &kern_pgdir[PDX(ULIM)],
+	       (NPDENTRIES - PDX(ULIM)) * sizeof(pde_t));
+	pte_sync(pgdir, NPDENTRIES * sizeof(pde_t));
+	return pgdir;
+}
+
+// Free an address space and everything mapped in its user half. It
+// must not be loaded.
+void pgdir_destroy(pde_t *pgdir)
+{
+	struct mem_region *rg = pa2region(PADDR(pgdir));
+
+	assert(rg->flags & REGION_PGDIR);
+	if (region_remove_range(pgdir, 0, ULIM) < 0)
+		panic("pgdir_destroy: out of memory");
+	anon_drop(pgdir);
+	rg->flags &= ~REGION_PGDIR;
+	rg->prev = NULL;
 	region_decref(rg);
-	if(ppte) {
-		*ppte = 0;
+}
+
+static inline bool attr_is_cow(uint32_t a)
+{
+	return (a & PTE_AP_MASK) == PTE_COW;
+}
+
+// Writable user mappings become copy-on-write; the rest are shared as
+// they are.
+static inline uint32_t attr_cow(uint32_t a)
+{
+	if ((a & PTE_AP_MASK) == PTE_RW_U)
+		a = (a & ~PTE_AP_MASK) | PTE_COW;
+	return a;
+}
+
+// Copy the user half of src into a new address space. All memory is
+// shared: writable user pages become copy-on-write in both, so only
+// the page tables are copied. Reservations are copied too. Returns
+// NULL if out of memory.
+pde_t *pgdir_clone(pde_t *src)
+{
+	const uint32_t sattr = attr_small2sect(PTE_ATTR);
+	const uint32_t lattr = attr_small2large(PTE_ATTR);
+	struct tlb_gather tlb;
+	pde_t *dst, pde;
+	pte_t *stbl, *dtbl, pte;
+	physaddr_t pa;
+	uintptr_t va;
+	int i, r = 0;
+
+	if ((dst = pgdir_create()) == NULL)
+		return NULL;
+	tlb_gather_init(&tlb, src);
+	for (va = 0; va < ULIM && r == 0; va += PTSIZE) {
+		pde = src[PDX(va)];
+		if ((pde & PDE_P) == PDE_ENTRY_1M) {
+			pde = (pde & ~sattr) |
+				attr_small2sect(attr_cow(attr_sect2small(pde)));
+			if (pde != src[PDX(va)]) {
+				src[PDX(va)] = pde;
+				pte_sync(&src[PDX(va)], sizeof(pde_t));
+				tlb_gather_add(&tlb, va);
+			}
+			dst[PDX(va)] = pde | attr_small2sect(PTE_NG);
+			if (pde_is_super(pde))
+				pa = (pde & ~(SSECTSIZE - 1)) + va % SSECTSIZE;
+			else
+				pa = pde & ~(PTSIZE - 1);
+			ref_range(pa, PTSIZE, 1);
+		} else if ((pde & PDE_P) == PDE_ENTRY) {
+			if ((dtbl = l2_alloc()) == NULL) {
+				r = -E_NO_MEM;
+				break;
+			}
+			stbl = (pte_t *)KADDR(PDE_ADDR(pde));
+			for (i = 0; i < NPTENTRIES; i++) {
+				if (!((pte = stbl[i]) & PTE_P))
+					continue;
+				if ((pte & PTE_P) == PTE_ENTRY_LARGE) {
+					pte = (pte & ~lattr) | attr_small2large(
+						attr_cow(attr_large2small(pte)));
+					pa = PTE_LARGE_ADDR(pte) + i % 16 * PGSIZE;
+				} else {
+					pte = (pte & ~PTE_ATTR) |
+						attr_cow(pte & PTE_ATTR);
+					pa = PTE_SMALL_ADDR(pte);
+				}
+				if (pte != stbl[i]) {
+					stbl[i] = pte;
+					tlb_gather_add(&tlb, va + i * PGSIZE);
+				}
+				dtbl[i] = pte | PTE_NG;
+				ref_range(pa, PGSIZE, 1);
+			}
+			pte_sync(stbl, L2_SIZE);
+			pte_sync(dtbl, L2_SIZE);
+			dst[PDX(va)] = PADDR(dtbl) | PDE_ENTRY;
+		}
+		pte_sync(&dst[PDX(va)], sizeof(pde_t));
 	}
-	tlb_invalidate(pgdir, va);
+	tlb_gather_flush(&tlb);
+	if (r < 0 || anon_clone(dst, src) < 0) {
+		pgdir_destroy(dst);
+		return NULL;
+	}
+	return dst;
+}
+
+// Resolve a write fault at va on a copy-on-write page. If nothing else
+// maps its region the mapping is made writable in place, else the
+// region is copied. The pages of the region mapped at the matching
+// offsets around va are resolved together. Returns -E_FAULT if va
+// isn't copy-on-write.
+int region_cow_fault(pde_t *pgdir, uintptr_t va)
+{
+	struct mem_region *rg, *copy = NULL;
+	uint32_t attr[MEM_UNIT / PGSIZE];
+	physaddr_t pa, rgpa;
+	uintptr_t base, v;
+	int i, n = 0, r = 0;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	pa = va2pa(pgdir, va, NULL);
+	if (pa == ~0 || pa >= nregions * MEM_UNIT ||
+	    !attr_is_cow(va_attr(pgdir, va)))
+		return -E_FAULT;
+	rg = pa2region(pa);
+	rgpa = region2pa(rg);
+	base = va - (pa - rgpa);
+	for (i = 0; i < MEM_UNIT / PGSIZE; i++) {
+		v = base + i * PGSIZE;
+		attr[i] = 0;
+		// a window wrapping around 0 only gets va itself
+		if (v != va && (va < pa - rgpa ||
+				va2pa(pgdir, v, NULL) != rgpa + i * PGSIZE))
+			continue;
+		if (attr_is_cow(attr[i] = va_attr(pgdir, v)))
+			n++;
+		else
+			attr[i] = 0;
+	}
+
+	if (rg->refn > n) {
+		if ((copy = region_alloc(0)) == NULL)
+			return -E_NO_MEM;
+		for (i = 0; i < MEM_UNIT / PGSIZE; i++)
+			if (attr[i])
+				memcpy((void *)(region2kva(copy) + i * PGSIZE),
+				       (void *)KADDR(rgpa + i * PGSIZE), PGSIZE);
+		rgpa = region2pa(copy);
+	}
+	for (i = 0; i < MEM_UNIT / PGSIZE && r == 0; i++)
+		if (attr[i])
+			r = insert_range(pgdir, base + i * PGSIZE,
+					 rgpa + i * PGSIZE, PGSIZE,
+					 (attr[i] & ~PTE_AP_MASK) | PTE_RW_U);
+	if (copy && copy->refn == 0)
+		region_free(copy);
+	return r;
+}
+
+struct mem_region* 
+region_lookup(pde_t *pgdir, uintptr_t va, pte_t **pte_store)
+{
+	physaddr_t pa = va2pa(pgdir, va, pte_store);
+
+	if (pa == ~0 || pa >= nregions * MEM_UNIT)
+		return NULL;
+	return pa2region(pa);
+}
+
+int
+region_insert(pde_t *pgdir, struct mem_region *rg, uintptr_t va, int perm)
+{
+	int r;
+	ALLOCSTAT_BEGIN();
+
+	r = region_insert_range(pgdir, rg, va, PGSIZE, perm);
+	ALLOCSTAT_END(AS_INSERT);
+	return r;
+}
+
+void
+region_remove(pde_t *pgdir, uintptr_t va)
+{
+	if (region_remove_range(pgdir, ROUNDDOWN(va, PGSIZE), PGSIZE) < 0)
+		panic("region_remove: out of memory splitting a section");
 }
 
 static physaddr_t
@@ -263,10 +1765,10 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	if (!(*pgdir & PDE_P))
 		return ~0;
 	
-	if ((*pgdir & PDE_ENTRY_1M) == PDE_ENTRY_1M) {
-		return (physaddr_t) (((*pgdir) & 0xFFF00000) + (va & 0xFFFFF));
-	} else if ((*pgdir & PDE_ENTRY_16M) == PDE_ENTRY_16M){
+	if ((*pgdir & PDE_ENTRY_16M) == PDE_ENTRY_16M) {
 	    return (physaddr_t) (((*pgdir) & 0xFF000000) + (va & 0xFFFFFF));
+	} else if ((*pgdir & PDE_ENTRY_1M) == PDE_ENTRY_1M){
+		return (physaddr_t) (((*pgdir) & 0xFFF00000) + (va & 0xFFFFF));
 	} else {
 		p = (pte_t*) KADDR(PDE_ADDR(*pgdir));
 		if (!(p[PTX(va)] & PTE_P))
@@ -283,17 +1785,97 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 }
 
 
+// Free blocks taken away by steal_free_regions().
+static struct mem_region *stolen_regions[REGION_MAX_ORDER + 1];
+static struct mem_region *stolen_zpool;
+static int stolen_zpool_n;
+static struct mem_region *stolen_l2_partial;
+static struct mem_extent stolen_extents[MAX_EXTENTS];
+static int stolen_nextents;
+
+// Temporarily take every free block away from the allocator, so a
+// check can control exactly which regions get handed out.
+static void
+steal_free_regions(void)
+{
+	struct mem_region *rg;
+
+	for (int o = 0; o <= REGION_MAX_ORDER; o++) {
+		stolen_regions[o] = free_area[o].head;
+		// stolen blocks must not coalesce with regions freed meanwhile
+		for (rg = free_area[o].head; rg; rg = rg->next)
+			rg->flags &= ~REGION_FREE;
+		free_area[o].head = NULL;
+		free_area[o].nfree = 0;
+	}
+	stolen_zpool = zpool.head;
+	stolen_zpool_n = zpool.n;
+	zpool.head = NULL;
+	zpool.n = 0;
+	stolen_l2_partial = l2_partial;
+	l2_partial = NULL;
+	memcpy(stolen_extents, extents, sizeof(extents));
+	stolen_nextents = nextents;
+	nextents = 0;
+	extent_free = 0;
+}
+
+// Give back the blocks taken by steal_free_regions().
+static void
+return_free_regions(void)
+{
+	struct mem_region *rg, *next;
+
+	for (int o = 0; o <= REGION_MAX_ORDER; o++) {
+		for (rg = stolen_regions[o]; rg; rg = next) {
+			next = rg->next;
+			rg->next = rg->prev = NULL;
+			region_free_order(rg, o);
+		}
+		stolen_regions[o] = NULL;
+	}
+	zpool_drain();
+	zpool.head = stolen_zpool;
+	zpool.n = stolen_zpool_n;
+	stolen_zpool = NULL;
+	while ((rg = stolen_l2_partial) != NULL) {
+		stolen_l2_partial = rg->next;
+		rg->next = rg->prev = NULL;
+		l2_partial_push(rg);
+	}
+	for (int i = 0; i < stolen_nextents; i++)
+		free_to_extents(stolen_extents[i].start, stolen_extents[i].len);
+	stolen_nextents = 0;
+}
+
 static void
 check_free_regions()
 {
     struct mem_region *rg;
     int count = 0;
-	assert( NULL != free_regions);
-    
-    for (rg = free_regions; rg; rg = rg->next) {
-        assert(rg->refn == 0);
-        count ++;
-    }
+	assert(count_free_regions() > 0);
+
+	for (int o = 0; o <= REGION_MAX_ORDER; o++) {
+		int n = 0;
+		for (rg = free_area[o].head; rg; rg = rg->next) {
+			assert(rg->refn == 0);
+			assert(rg->flags & REGION_FREE);
+			assert(rg->order == o);
+			assert(((rg - regions) & ((1 << o) - 1)) == 0);
+			n++;
+		}
+		assert(n == free_area[o].nfree);
+		count += n << o;
+	}
+	for (int i = 0; i < nextents; i++) {
+		assert(extents[i].len > 0);
+		assert(extents[i].start + extents[i].len <= nregions);
+		// sorted, and adjacent extents would have been merged
+		assert(i == 0 || extents[i - 1].start + extents[i - 1].len
+				 < extents[i].start);
+		count += extents[i].len;
+	}
+	assert(count == count_free_regions());
     cprintf("check_free_regions() succeeded!\n");
 }
 
@@ -302,13 +1884,11 @@ check_region_alloc(void)
 {
 	struct mem_region *pp, *pp0, *pp1, *pp2;
 	int nfree;
-	struct mem_region *fl;
 	char *c;
 	int i;
 
 	// check number of free regions
-	for (pp = free_regions, nfree = 0; pp; pp = pp->next)
-		++nfree;
+	nfree = count_free_regions();
 
 	// should be able to allocate three regions
 	pp0 = pp1 = pp2 = 0;
@@ -319,13 +1899,12 @@ check_region_alloc(void)
 	assert(pp0);
 	assert(pp1 && pp1 != pp0);
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
-	assert(region2pa(pp0) < MAX_REGION*MEM_UNIT);
-	assert(region2pa(pp1) < MAX_REGION*MEM_UNIT);
-	assert(region2pa(pp2) < MAX_REGION*MEM_UNIT);
+	assert(region2pa(pp0) < nregions*MEM_UNIT);
+	assert(region2pa(pp1) < nregions*MEM_UNIT);
+	assert(region2pa(pp2) < nregions*MEM_UNIT);
 
 	// temporarily steal the rest of the free regions
-	fl = free_regions;
-    free_regions = 0;
+	steal_free_regions();
 
 	// should be no free memory
 	assert(!region_alloc(0));
@@ -353,7 +1932,7 @@ check_region_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	free_regions = fl;
+	return_free_regions();
 
 	// free the regions we took
 	region_free(pp0);
@@ -361,10 +1940,65 @@ check_region_alloc(void)
 	region_free(pp2);
 
 	// number of free regions should be the same
-	for (pp = free_regions; pp; pp = pp->next)
-		--nfree;
-	assert(nfree == 0);
-	
+	assert(nfree == count_free_regions());
+
+	// blocks of every order are contiguous and aligned to their size
+	for (i = 0; i <= REGION_MAX_ORDER; i++) {
+		assert((pp = region_alloc_order(i, 0)));
+		assert(region2pa(pp) % (MEM_UNIT << i) == 0);
+		assert(count_free_regions() == nfree - (1 << i));
+		region_free_order(pp, i);
+		assert(count_free_regions() == nfree);
+	}
+	assert(!region_alloc_order(REGION_MAX_ORDER + 1, 0));
+
+	// splitting a block and freeing the halves coalesces it again
+	steal_free_regions();
+	assert((pp = region_alloc_order(6, 0)) == NULL);
+	return_free_regions();
+	assert((pp = region_alloc_order(6, 0)));
+	steal_free_regions();
+	region_free_order(pp, 6);
+	assert((pp0 = region_alloc(0)) == pp);
+	assert((pp1 = region_alloc_order(5, 0)) == pp + 32);
+	assert(region_alloc_order(5, 0) == NULL);
+	assert((pp2 = region_alloc(0)) == pp + 1);
+	region_free(pp0);
+	region_free(pp2);
+	region_free_order(pp1, 5);
+	assert(region_alloc_order(6, 0) == pp);
+	assert(!region_alloc(0));
+	region_free_order(pp, 6);
+	return_free_regions();
+	assert(nfree == count_free_regions());
+
+	// large ranges come from the extents in one call...
+	assert((pp = region_alloc_range(1000, 0)));
+	assert(count_free_regions() == nfree - 1000);
+	for (i = 0; i < 1000; i++)
+		assert(pp[i].refn == 0 && pp[i].next == NULL && pp[i].flags == 0);
+	// ... and can be given back piecewise
+	region_free_range(pp + 500, 250);
+	assert(count_free_regions() == nfree - 750);
+	region_free_range(pp, 500);
+	region_free_range(pp + 750, 250);
+	assert(count_free_regions() == nfree);
+	assert(!region_alloc_range(nregions, 0));
+	assert((pp = region_alloc_range(2, 0)));
+	steal_free_regions();
+	assert(!region_alloc_range(1, 0));
+	region_free_range(pp, 2);
+	assert(region_alloc_range(2, 0) == pp);
+	region_free_range(pp, 2);
+	// a freed range feeds the buddy allocator too
+	assert(region_alloc(0) == pp);
+	assert(region_alloc(0) == pp + 1);
+	assert(!region_alloc(0));
+	region_free(pp);
+	region_free(pp + 1);
+	return_free_regions();
+	assert(nfree == count_free_regions());
+
 	cprintf("check_region_alloc() succeeded!\n");
 }
 
@@ -373,10 +2007,9 @@ static void
 check_region(void)
 {
 	struct mem_region *pp, *pp0, *pp1, *pp2;
-	struct mem_region *fl;
 	pte_t *ptep, *ptep1;
 	uintptr_t va;
-	uintptr_t mm1, mm2;
+	uintptr_t mm1, mm2, mm3, mm4, mm5;
 	int i;
 
 	// should be able to allocate three regions
@@ -390,8 +2023,7 @@ check_region(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free regions
-	fl = free_regions;
-	free_regions = 0;
+	steal_free_regions();
 
 	// should be no free memory
 	assert(!region_alloc(0));
@@ -405,10 +2037,11 @@ check_region(void)
 	// free pp0 and try again: pp0 should be used for page table
 	region_free(pp0);
 	assert(region_insert(kern_pgdir, pp1, 0x0, PTE_NONE_U) == 0);
-	assert(PTE_SMALL_ADDR(kern_pgdir[0]) == region2pa(pp0));
+	assert(PDE_ADDR(kern_pgdir[0]) == region2pa(pp0));
 	assert(check_va2pa(kern_pgdir, 0x0) == region2pa(pp1));
 	assert(pp1->refn == 1);
 	assert(pp0->refn == 1);
+	assert((pp0->flags & REGION_L2) && pp0->l2_used == 0x1);
 
 	// should be able to map pp2 at PGSIZE because pp0 is already allocated for page table
 	assert(region_insert(kern_pgdir, pp2,  PGSIZE, PTE_NONE_U) == 0);
@@ -428,7 +2061,7 @@ check_region(void)
 	assert(!region_alloc(0));
 
 	// check that pgdir_walk returns a pointer to the pte
-	ptep = (pte_t *) KADDR(PTE_SMALL_ADDR(kern_pgdir[PDX(PGSIZE)]));
+	ptep = (pte_t *) KADDR(PDE_ADDR(kern_pgdir[PDX(PGSIZE)]));
 	assert(pgdir_walk(kern_pgdir, PGSIZE, 0) == ptep+PTX(PGSIZE));
 
 	// should be able to change permissions too.
@@ -442,8 +2075,25 @@ check_region(void)
 	assert(*pgdir_walk(kern_pgdir,  PGSIZE, 0) & PTE_NONE_U);
 	assert((*pgdir_walk(kern_pgdir,  PGSIZE, 0) & PTE_RW_U) != PTE_RW_U);
 
-	// should not be able to map at PTSIZE because need free page for page table
-	assert(region_insert(kern_pgdir, pp0,  PTSIZE, PTE_NONE_U) < 0);
+	// strongly-ordered is asked for with PERM_MEM_SO, as its type is 0
+	assert((*pgdir_walk(kern_pgdir, PGSIZE, 0) & PTE_MEM_MASK) == PTE_MEM_NORMAL);
+	assert(region_insert(kern_pgdir, pp2, PGSIZE, PTE_NONE_U | PERM_MEM_SO) == 0);
+	assert((*pgdir_walk(kern_pgdir, PGSIZE, 0) & PTE_MEM_MASK) == PTE_MEM_SO);
+	assert(check_va2pa(kern_pgdir, PGSIZE) == region2pa(pp2));
+	assert(pp2->refn == 1);
+
+	// the page table for PTSIZE shares pp0 with the one for 0, so no
+	// free page is needed
+	assert(region_insert(kern_pgdir, pp2,  PTSIZE, PTE_NONE_U) == 0);
+	assert(PDE_ADDR(kern_pgdir[PDX(PTSIZE)]) == region2pa(pp0) + L2_SIZE);
+	assert(check_va2pa(kern_pgdir, PTSIZE) == region2pa(pp2));
+	assert(pp0->refn == 1 && pp0->l2_used == 0x3);
+	assert(pp2->refn == 2);
+	region_remove(kern_pgdir, PTSIZE);
+	assert(pp2->refn == 1);
+	pgdir_free_table(kern_pgdir, PTSIZE);
+	assert(pp0->refn == 1 && pp0->l2_used == 0x1);
+	assert(!region_alloc(0));
 
 	// insert pp1 at PGSIZE (replacing pp2)
 	assert(region_insert(kern_pgdir, pp1,  PGSIZE, PTE_NONE_U) == 0);
@@ -484,70 +2134,353 @@ check_region(void)
 	// should be no free memory
 	assert(!region_alloc(0));
 
-	// forcibly take pp0 back
-	assert(PTE_SMALL_ADDR(kern_pgdir[0]) == region2pa(pp0));
-	kern_pgdir[0] = 0;
+	// freeing the last page table in pp0 gives pp0 back
+	assert(PDE_ADDR(kern_pgdir[0]) == region2pa(pp0));
 	assert(pp0->refn == 1);
-	pp0->refn = 0;
+	pgdir_free_table(kern_pgdir, 0x0);
+	assert(pp0->refn == 0);
+	assert(!(pp0->flags & REGION_L2));
 
 	// check pointer arithmetic in pgdir_walk
-	region_free(pp0);
 	va = (PGSIZE * NPDENTRIES + PGSIZE);
 	ptep = pgdir_walk(kern_pgdir, va, 1);
-	ptep1 = (pte_t *) KADDR(PTE_SMALL_ADDR(kern_pgdir[PDX(va)]));
+	ptep1 = (pte_t *) KADDR(PDE_ADDR(kern_pgdir[PDX(va)]));
+	assert(ptep1 == (pte_t *) region2kva(pp0));
 	assert(ptep == ptep1 + PTX(va));
-	kern_pgdir[PDX(va)] = 0;
-	pp0->refn = 0;
+	pgdir_free_table(kern_pgdir, va);
+	assert(pp0->refn == 0);
 
 	// check that new page tables get cleared
-	memset((void*)region2kva(pp0), 0xFF, PGSIZE);
-	region_free(pp0);
+	memset((void*)region2kva(pp0), 0xFF, MEM_UNIT);
 	pgdir_walk(kern_pgdir, 0x0, 1);
 	ptep = (pte_t *) region2kva(pp0);
 	for(i=0; i<NPTENTRIES; i++)
 		assert((ptep[i] & PTE_P) == 0);
-	kern_pgdir[0] = 0;
-	pp0->refn = 0;
-	
-	// give free list back
-	free_regions = fl;
+	pgdir_free_table(kern_pgdir, 0x0);
 
-	// free the regions we took
-	region_free(pp0);
+	// L2_PER_REGION page tables share a region; the next one takes
+	// another region, and each region is returned when its last page
+	// table is freed
 	region_free(pp1);
+	for (i = 0; i <= L2_PER_REGION; i++)
+		assert(pgdir_walk(kern_pgdir, i * PTSIZE, 1));
+	pp = pa2region(PDE_ADDR(kern_pgdir[0]));
+	assert(pp == pp0 || pp == pp1);
+	for (i = 0; i < L2_PER_REGION; i++)
+		assert(PDE_ADDR(kern_pgdir[i]) == region2pa(pp) + i * L2_SIZE);
+	assert(pp->l2_used == (1 << L2_PER_REGION) - 1);
+	assert(PDE_ADDR(kern_pgdir[L2_PER_REGION])
+	       == region2pa(pp == pp0 ? pp1 : pp0));
+	assert(!region_alloc(0));
+	for (i = 0; i < L2_PER_REGION; i++) {
+		assert(pp->refn == 1);
+		pgdir_free_table(kern_pgdir, i * PTSIZE);
+	}
+	assert(pp->refn == 0);
+	pgdir_free_table(kern_pgdir, L2_PER_REGION * PTSIZE);
+	assert(pp0->refn == 0 && pp1->refn == 0);
+
+	// give free list back
+	return_free_regions();
+
+	// free the region we took
 	region_free(pp2);
 
 	// test mmio_map_region
-	mm1 = (uintptr_t) mmio_map_region(0, 4097);
-	mm2 = (uintptr_t) mmio_map_region(0, 4096);
-	// check that they're in the right region
-	assert(mm1 >= MMIOBASE && mm1 + 8096 < MMIOLIM);
-	assert(mm2 >= MMIOBASE && mm2 + 8096 < MMIOLIM);
-	// check that they're page-aligned
-	assert(mm1 % PGSIZE == 0 && mm2 % PGSIZE == 0);
-	// check that they don't overlap
-	assert(mm1 + 8096 <= mm2);
+	mm1 = mmio_map_region(0, 4097);
+	mm2 = mmio_map_region(0, 4096);
+	mm3 = mmio_map_region(PGSIZE + 0x10, 4);
+	// check that it's in the right region and page-aligned
+	assert(mm1 >= MMIOBASE && mm1 + 2 * PGSIZE <= MMIOLIM);
+	assert(mm1 % PGSIZE == 0);
+	// the same device shares the window
+	assert(mm2 == mm1 && mm3 == mm1 + PGSIZE + 0x10);
 	// check page mappings
 	assert(check_va2pa(kern_pgdir, mm1) == 0);
 	assert(check_va2pa(kern_pgdir, mm1+PGSIZE) == PGSIZE);
-	assert(check_va2pa(kern_pgdir, mm2) == 0);
-	assert(check_va2pa(kern_pgdir, mm2+PGSIZE) == ~0);
 	// check permissions
 	assert((*pgdir_walk(kern_pgdir,  mm1, 0) & (PTE_NONE_U)) == PTE_NONE_U);
 	assert(PTE_RW_U != (*pgdir_walk(kern_pgdir,  mm1, 0) & PTE_RW_U));
-	// clear the mappings
-	*pgdir_walk(kern_pgdir,  mm1, 0) = 0;
-	*pgdir_walk(kern_pgdir,  mm1 + PGSIZE, 0) = 0;
-	*pgdir_walk(kern_pgdir,  mm2, 0) = 0;
+	// device memory is never cached or executed
+	assert((*pgdir_walk(kern_pgdir, mm1, 0) & PTE_MEM_MASK) == PTE_MEM_DEVICE);
+	assert(*pgdir_walk(kern_pgdir, mm1, 0) & PTE_XN);
+	// strongly-ordered gets a window of its own
+	mm4 = mmio_map_attr(0, 4096, PTE_MEM_SO);
+	assert(mm4 != mm1 && check_va2pa(kern_pgdir, mm4) == 0);
+	assert((*pgdir_walk(kern_pgdir, mm4, 0) & PTE_MEM_MASK) == PTE_MEM_SO);
+	// a big window gets large pages and sections
+	mm5 = mmio_map_region(0x40010000, 2 * PTSIZE);
+	assert(mm5 % PTSIZE == 0x10000);
+	assert((*pgdir_walk(kern_pgdir, mm5, 0) & PTE_P) == PTE_ENTRY_LARGE);
+	assert((kern_pgdir[PDX(mm5) + 1] & PDE_P) == PDE_ENTRY_1M);
+	assert((kern_pgdir[PDX(mm5) + 1] & PDE_MEM_MASK) == PDE_MEM_DEVICE);
+	assert(check_va2pa(kern_pgdir, mm5 + 2 * PTSIZE - 1) == 0x4020ffff);
+	// the last unmap releases the window, and its space is reused
+	assert(mmio_unmap_region(mm1) == 0 && mmio_unmap_region(mm2) == 0);
+	assert(check_va2pa(kern_pgdir, mm1) == 0);
+	assert(mmio_unmap_region(mm3) == 0);
+	assert(check_va2pa(kern_pgdir, mm1) == ~0);
+	assert(mmio_unmap_region(mm4) == 0 && mmio_unmap_region(mm5) == 0);
+	assert(mmio_unmap_region(mm5) == -E_INVAL);
+	assert(check_va2pa(kern_pgdir, mm4) == ~0);
+	assert(check_va2pa(kern_pgdir, mm5 + PTSIZE) == ~0);
+	assert(mmio_map_region(0x1000, 4096) == mm1);
+	assert(mmio_unmap_region(mm1) == 0 && nmmio == 0);
 	
     cprintf("check_region() succeeded!\n");
 }
 
+// check that region_insert_range picks the largest pages it can, that
+// region_remove_range splits them, and that region_populate_range
+// allocates blocks to match
+static void
+check_region_map(void)
+{
+	struct tlb_gather tlb;
+	struct mem_region *pp;
+	uintptr_t va = 0x10000000;
+	physaddr_t pa;
+	pte_t *ptep;
+	int nfree, i;
+
+	nfree = nfree_regions();
+
+	// a 1MiB block at a 1MiB boundary is a single section
+	assert((pp = region_alloc_order(6, 0)));
+	pa = region2pa(pp);
+	assert(region_insert_range(kern_pgdir, pp, va, PTSIZE, PTE_RW_U) == 0);
+	assert((kern_pgdir[PDX(va)] & PDE_P) == PDE_ENTRY_1M);
+	assert(!(kern_pgdir[PDX(va)] & (1 << 18)));
+	assert((kern_pgdir[PDX(va)] & PDE_RW_U) == PDE_RW_U);
+	assert((kern_pgdir[PDX(va)] & PDE_MEM_MASK) == PDE_MEM_NORMAL);
+	assert(check_va2pa(kern_pgdir, va + 0x12345) == pa + 0x12345);
+	for (i = 0; i < PTSIZE / MEM_UNIT; i++)
+		assert(pp[i].refn == MEM_UNIT / PGSIZE);
+	assert(region_lookup(kern_pgdir, va + 0x54321, &ptep) ==
+	       pa2region(pa + 0x54321));
+
+	// unmapping one page splits it into large pages, and the large
+	// page around the hole into small ones
+	assert(region_remove_range(kern_pgdir, va + LPGSIZE, PGSIZE) == 0);
+	assert((kern_pgdir[PDX(va)] & PDE_P) == PDE_ENTRY);
+	assert((*pgdir_walk(kern_pgdir, va, 0) & PTE_P) == PTE_ENTRY_LARGE);
+	assert((*pgdir_walk(kern_pgdir, va, 0) & PTE_RW_U) == PTE_RW_U);
+	assert((*pgdir_walk(kern_pgdir, va + LPGSIZE + PGSIZE, 0) & PTE_P)
+	       == PTE_ENTRY_SMALL);
+	assert((*pgdir_walk(kern_pgdir, va + LPGSIZE + PGSIZE, 0) & PTE_RW_U)
+	       == PTE_RW_U);
+	// and keeps the memory type
+	assert((*pgdir_walk(kern_pgdir, va + LPGSIZE + PGSIZE, 0) & PTE_MEM_MASK)
+	       == PTE_MEM_NORMAL);
+	assert(check_va2pa(kern_pgdir, va + LPGSIZE) == ~0);
+	assert(check_va2pa(kern_pgdir, va + LPGSIZE + PGSIZE + 8)
+	       == pa + LPGSIZE + PGSIZE + 8);
+	assert(check_va2pa(kern_pgdir, va + PTSIZE - 4) == pa + PTSIZE - 4);
+	assert(pa2region(pa + LPGSIZE)->refn == MEM_UNIT / PGSIZE - 1);
+	assert(pp->refn == MEM_UNIT / PGSIZE);
+
+	// unmapping the rest frees the page table and the regions
+	assert(region_remove_range(kern_pgdir, va, PTSIZE) == 0);
+	assert(kern_pgdir[PDX(va)] == 0);
+	assert(nfree_regions() == nfree);
+
+	// a misaligned va only gets small pages; a 64KiB aligned one gets
+	// large pages
+	assert((pp = region_alloc_order(2, 0)));
+	pa = region2pa(pp);
+	assert(region_insert_range(kern_pgdir, pp, va + PGSIZE, LPGSIZE, PTE_NONE_U) == 0);
+	for (i = 0; i < LPGSIZE; i += PGSIZE) {
+		assert((*pgdir_walk(kern_pgdir, va + PGSIZE + i, 0) & PTE_P)
+		       == PTE_ENTRY_SMALL);
+		assert(check_va2pa(kern_pgdir, va + PGSIZE + i) == pa + i);
+	}
+	// remapping in place keeps the regions alive
+	assert(region_insert_range(kern_pgdir, pp, va + 2 * LPGSIZE, LPGSIZE, PTE_NONE_U) == 0);
+	assert(region_remove_range(kern_pgdir, va + PGSIZE, LPGSIZE) == 0);
+	assert(pp->refn == MEM_UNIT / PGSIZE);
+	assert(region_insert_range(kern_pgdir, pp, va + 2 * LPGSIZE, LPGSIZE, PTE_RW_U) == 0);
+	assert(pp->refn == MEM_UNIT / PGSIZE);
+	for (i = 0; i < 16; i++)
+		assert((pgdir_walk(kern_pgdir, va + 2 * LPGSIZE, 0)[i] & PTE_P)
+		       == PTE_ENTRY_LARGE);
+	assert(check_va2pa(kern_pgdir, va + 3 * LPGSIZE - 1) == pa + LPGSIZE - 1);
+	assert(region_remove_range(kern_pgdir, va, PTSIZE) == 0);
+	assert(kern_pgdir[PDX(va)] == 0);
+	assert(nfree_regions() == nfree);
+
+	// a range across page tables takes references a region at a time
+	// and gives back the runs of regions it stops using
+	assert((pp = region_alloc_order(7, 0)));
+	pa = region2pa(pp);
+	assert(region_insert_range(kern_pgdir, pp, va + PTSIZE - 3 * PGSIZE,
+				   2 * PTSIZE, PTE_RW_U) == 0);
+	for (i = 0; i < 2 * PTSIZE / MEM_UNIT; i++)
+		assert(pp[i].refn == MEM_UNIT / PGSIZE);
+	assert(check_va2pa(kern_pgdir, va + PTSIZE - 3 * PGSIZE) == pa);
+	assert(check_va2pa(kern_pgdir, va + 3 * PTSIZE - 4 * PGSIZE)
+	       == pa + 2 * PTSIZE - PGSIZE);
+	assert(region_remove_range(kern_pgdir, va + PTSIZE - 2 * PGSIZE,
+				   PTSIZE) == 0);
+	assert(pp[0].refn == 1);
+	for (i = 1; i < PTSIZE / MEM_UNIT; i++)
+		assert(pp[i].refn == 0);
+	assert(pp[PTSIZE / MEM_UNIT].refn == MEM_UNIT / PGSIZE - 1);
+	assert(nfree_regions() == nfree - PTSIZE / MEM_UNIT - 1);
+	assert(check_va2pa(kern_pgdir, va + 2 * PTSIZE - 3 * PGSIZE) == ~0);
+	assert(check_va2pa(kern_pgdir, va + 2 * PTSIZE - 2 * PGSIZE)
+	       == pa + PTSIZE + PGSIZE);
+	assert(region_remove_range(kern_pgdir, va, 3 * PTSIZE) == 0);
+	for (i = 0; i < 3; i++)
+		assert(kern_pgdir[PDX(va) + i] == 0);
+	assert(nfree_regions() == nfree);
+
+	// populating takes blocks as large as va's alignment allows
+	assert(region_populate_range(kern_pgdir, va + PTSIZE - LPGSIZE,
+				     PTSIZE + LPGSIZE + PGSIZE, PTE_RW_U) == 0);
+	assert((*pgdir_walk(kern_pgdir, va + PTSIZE - LPGSIZE, 0) & PTE_P)
+	       == PTE_ENTRY_LARGE);
+	assert((kern_pgdir[PDX(va) + 1] & PDE_P) == PDE_ENTRY_1M);
+	assert((*pgdir_walk(kern_pgdir, va + 2 * PTSIZE, 0) & PTE_P)
+	       == PTE_ENTRY_SMALL);
+	for (i = 0; i < PTSIZE + LPGSIZE + PGSIZE; i += PGSIZE / 4) {
+		pa = check_va2pa(kern_pgdir, va + PTSIZE - LPGSIZE + i);
+		assert(pa != ~0 && *(uint32_t *)KADDR(pa) == 0);
+	}
+	assert(region_remove_range(kern_pgdir, va, 3 * PTSIZE) == 0);
+	assert(nfree_regions() == nfree);
+
+	// a 16MiB block becomes a supersection, if there is one to spare
+	if ((pp = region_alloc_order(REGION_MAX_ORDER, 0))) {
+		pa = region2pa(pp);
+		assert(region_insert_range(kern_pgdir, pp, va, SSECTSIZE, PTE_NONE_U) == 0);
+		for (i = 0; i < 16; i++)
+			assert((kern_pgdir[PDX(va) + i] & PDE_ENTRY_16M)
+			       == PDE_ENTRY_16M);
+		assert(check_va2pa(kern_pgdir, va + 0xabcdef) == pa + 0xabcdef);
+		// a hole in the middle leaves sections around it
+		assert(region_remove_range(kern_pgdir, va + 5 * PTSIZE + PGSIZE, PGSIZE) == 0);
+		assert((kern_pgdir[PDX(va) + 4] & (PDE_ENTRY_16M | PDE_P))
+		       == PDE_ENTRY_1M);
+		assert((kern_pgdir[PDX(va) + 5] & PDE_P) == PDE_ENTRY);
+		assert(check_va2pa(kern_pgdir, va + 5 * PTSIZE + PGSIZE) == ~0);
+		assert(check_va2pa(kern_pgdir, va + 5 * PTSIZE) == pa + 5 * PTSIZE);
+		assert(check_va2pa(kern_pgdir, va + 15 * PTSIZE + 7)
+		       == pa + 15 * PTSIZE + 7);
+		assert(region_remove_range(kern_pgdir, va, SSECTSIZE) == 0);
+		for (i = 0; i < 16; i++)
+			assert(kern_pgdir[PDX(va) + i] == 0);
+		assert(nfree_regions() == nfree);
+	}
+
+	// unmapped memory and page tables are only released when the
+	// gather is flushed
+	assert((pp = region_alloc_order(2, 0)));
+	assert(region_insert_range(kern_pgdir, pp, va, LPGSIZE, PTE_NONE_U) == 0);
+	tlb_gather_init(&tlb, kern_pgdir);
+	assert(unmap_range(kern_pgdir, va, PTSIZE, true, &tlb) == 0);
+	assert(kern_pgdir[PDX(va)] == 0 && tlb.ntables == 1 && tlb.nruns == 1);
+	assert(pp->refn == MEM_UNIT / PGSIZE && nfree_regions() < nfree);
+	tlb_gather_flush(&tlb);
+	assert(tlb.ntables == 0 && tlb.nruns == 0);
+	assert(nfree_regions() == nfree);
+
+	// memory populated for the kernel is no-execute too
+	va = MMIOLIM - PGSIZE;
+	assert(region_populate_range(kern_pgdir, va, PGSIZE, PTE_NONE_U) == 0);
+	assert(*pgdir_walk(kern_pgdir, va, 0) & PTE_XN);
+	assert(region_remove_range(kern_pgdir, va, PGSIZE) == 0);
+	assert(nfree_regions() == nfree);
+
+	cprintf("check_region_map() succeeded!\n");
+}
+
+// check copy-on-write sharing through pgdir_clone and region_cow_fault
+static void
+check_region_cow(void)
+{
+	struct mem_region *pp, *pp1;
+	pde_t *pgdir0, *pgdir1;
+	uintptr_t va = 0x10000000;
+	physaddr_t pa;
+	int nfree, i;
+
+	nfree = nfree_regions();
+	assert((pgdir0 = pgdir_create()));
+	// two writable pages of pp and a read-only page of pp1
+	assert((pp = region_alloc(0)));
+	pa = region2pa(pp);
+	memset((void *)KADDR(pa), 0x5a, 2 * PGSIZE);
+	assert(region_insert_range(pgdir0, pp, va, 2 * PGSIZE, PTE_RW_U) == 0);
+	assert((pp1 = region_alloc(ALLOC_ZERO)));
+	assert(region_insert(pgdir0, pp1, va + MEM_UNIT, PTE_APX | PTE_RW_U) == 0);
+	// writable pages don't fault
+	assert(region_cow_fault(pgdir0, va) == -E_FAULT);
+
+	// cloning shares everything; the writable pages become
+	// copy-on-write in both
+	assert((pgdir1 = pgdir_clone(pgdir0)));
+	assert(pp->refn == 4 && pp1->refn == 2);
+	for (i = 0; i < 2; i++) {
+		assert(check_va2pa(pgdir0, va + i * PGSIZE) == pa + i * PGSIZE);
+		assert(check_va2pa(pgdir1, va + i * PGSIZE) == pa + i * PGSIZE);
+		assert(attr_is_cow(va_attr(pgdir0, va + i * PGSIZE)));
+		assert(attr_is_cow(va_attr(pgdir1, va + i * PGSIZE)));
+		assert(va_attr(pgdir1, va + i * PGSIZE) & PTE_NG);
+	}
+	assert((va_attr(pgdir1, va + MEM_UNIT) & PTE_AP_MASK)
+	       == (PTE_APX | PTE_RW_U));
+	assert(region_cow_fault(pgdir1, va + MEM_UNIT) == -E_FAULT);
+
+	// a write there copies both pages of the region
+	assert(region_cow_fault(pgdir1, va + PGSIZE + 12) == 0);
+	assert(pp->refn == 2);
+	for (i = 0; i < 2; i++) {
+		assert(check_va2pa(pgdir1, va + i * PGSIZE)
+		       == check_va2pa(pgdir1, va) + i * PGSIZE);
+		assert(check_va2pa(pgdir1, va + i * PGSIZE) != pa + i * PGSIZE);
+		assert((va_attr(pgdir1, va + i * PGSIZE) & PTE_AP_MASK)
+		       == PTE_RW_U);
+		assert(memcmp((void *)KADDR(check_va2pa(pgdir1, va + i * PGSIZE)),
+			      (void *)KADDR(pa + i * PGSIZE), PGSIZE) == 0);
+	}
+	// which leaves pgdir0 the only user, so it writes in place
+	assert(region_cow_fault(pgdir0, va) == 0);
+	assert(check_va2pa(pgdir0, va) == pa);
+	assert(check_va2pa(pgdir0, va + PGSIZE) == pa + PGSIZE);
+	assert((va_attr(pgdir0, va + PGSIZE) & PTE_AP_MASK) == PTE_RW_U);
+	assert(pp->refn == 2);
+
+	// a copy-on-write section is split, and only the region written
+	// to is copied
+	assert((pp = region_alloc_order(6, 0)));
+	pa = region2pa(pp);
+	assert(region_insert_range(pgdir0, pp, va + PTSIZE, PTSIZE, PTE_RW_U) == 0);
+	pgdir_destroy(pgdir1);
+	assert((pgdir1 = pgdir_clone(pgdir0)));
+	assert((pgdir1[PDX(va + PTSIZE)] & PDE_P) == PDE_ENTRY_1M);
+	assert(region_cow_fault(pgdir1, va + PTSIZE + 5 * MEM_UNIT) == 0);
+	assert((pgdir1[PDX(va + PTSIZE)] & PDE_P) == PDE_ENTRY);
+	assert((pgdir0[PDX(va + PTSIZE)] & PDE_P) == PDE_ENTRY_1M);
+	assert(check_va2pa(pgdir1, va + PTSIZE + 5 * MEM_UNIT)
+	       != pa + 5 * MEM_UNIT);
+	assert(check_va2pa(pgdir1, va + PTSIZE + 6 * MEM_UNIT)
+	       == pa + 6 * MEM_UNIT);
+	assert(pp[5].refn == MEM_UNIT / PGSIZE);
+	assert(pp[6].refn == 2 * MEM_UNIT / PGSIZE);
+
+	pgdir_destroy(pgdir0);
+	pgdir_destroy(pgdir1);
+	assert(nfree_regions() == nfree);
+
+	cprintf("check_region_cow() succeeded!\n");
+}
+
 
 static void
 check_kern_pgdir(void)
 {
-	uint32_t i;
+	extern char etext[], erodata[];
+	uint32_t i, mask;
 	pde_t *pgdir;
 
 	pgdir = kern_pgdir;
@@ -570,7 +2503,7 @@ check_kern_pgdir(void)
     
     
 	// check phys mem
-	for (i = 0; i < MAX_REGION * PGSIZE; i += PGSIZE)
+	for (i = 0; i < nregions * MEM_UNIT; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
     /*
@@ -591,20 +2524,51 @@ check_kern_pgdir(void)
 		switch (i) {
 		case PDX(KSTACKTOP-1):
 		//comment for lab3 case PDX(UENVS):
-		case PDX(MMIOBASE):
 		case PDX(MCONSOLE):
 			assert(pgdir[i] & PDE_P);
 			break;
 		default:
-			if (i >= PDX(KERNBASE)) {
+			// the MMIO windows come and go
+			if (i >= PDX(MMIOBASE) && i < PDX(MMIOLIM))
+				break;
+			if (i >= PDX(KERNBASE) && i < PDX(KERNBASE) +
+			    ROUNDUP(nregions * MEM_UNIT, PTSIZE) / PTSIZE) {
 				assert(pgdir[i] & PTE_P);
-				assert(PDE_NONE_U == (pgdir[i] & PDE_NONE_U));
+				assert((va_attr(pgdir, i << PDXSHIFT) & PTE_AP_MASK)
+				       == PTE_NONE_U ||
+				       (va_attr(pgdir, i << PDXSHIFT) & PTE_AP_MASK)
+				       == PTE_RO_NONE_U);
 			} else {
 				assert(pgdir[i] == 0);
 			}
 			break;
 		}
 	}
+
+	// past the kernel image's 16MiB, RAM is mapped with supersections
+	for (i = SSECTSIZE; i + SSECTSIZE <=
+	     MIN(nregions * MEM_UNIT, boot_directmap_size); i += SSECTSIZE)
+		assert(pde_is_super(pgdir[PDX(KERNBASE + i)]));
+
+	// only kernel text is executable, and it is read-only; all of it
+	// is global
+	mask = PTE_AP_MASK | PTE_XN | PTE_NG;
+	assert((va_attr(pgdir, (uintptr_t)check_kern_pgdir) & mask) ==
+	       PTE_RO_NONE_U);
+	assert((va_attr(pgdir, (uintptr_t)etext - 1) & mask) == PTE_RO_NONE_U);
+	assert((va_attr(pgdir, (uintptr_t)etext) & mask) ==
+	       (PTE_RO_NONE_U | PTE_XN));
+	assert((va_attr(pgdir, (uintptr_t)"rodata") & mask) ==
+	       (PTE_RO_NONE_U | PTE_XN));
+	assert((va_attr(pgdir, (uintptr_t)&nregions) & mask) ==
+	       (PTE_NONE_U | PTE_XN));
+	assert((va_attr(pgdir, (uintptr_t)erodata) & mask) ==
+	       (PTE_NONE_U | PTE_XN));
+	assert((va_attr(pgdir, KERNBASE) & mask) == (PTE_NONE_U | PTE_XN));
+	assert((va_attr(pgdir, KADDR(nregions * MEM_UNIT - 1)) & mask) ==
+	       (PTE_NONE_U | PTE_XN));
+	assert((va_attr(pgdir, KSTACKTOP - 1) & mask) == (PTE_NONE_U | PTE_XN));
+	assert((va_attr(pgdir, MCONSOLE) & mask) == (PTE_NONE_U | PTE_XN));
 	cprintf("check_kern_pgdir() succeeded!\n");
 }
 
@@ -619,6 +2583,8 @@ check_region_installed_pgdir(void)
 	assert((pp0 = region_alloc(0)));
 	assert((pp1 = region_alloc(0)));
 	assert((pp2 = region_alloc(0)));
+	// keep pp0 the only free region, so it backs the page table
+	steal_free_regions();
 	region_free(pp0);
 	memset((void*)region2kva(pp1), 1, PGSIZE);
 	memset((void*)region2kva(pp2), 2, PGSIZE);
@@ -634,22 +2600,12 @@ check_region_installed_pgdir(void)
 	region_remove(kern_pgdir,  PGSIZE);
 	assert(pp2->refn == 0);
 
-	// forcibly take pp0 back
-	assert(PTE_SMALL_ADDR(kern_pgdir[0]) == region2pa(pp0));
-	kern_pgdir[0] = 0;
+	// free the page table, which gives pp0 back
+	assert(PDE_ADDR(kern_pgdir[0]) == region2pa(pp0));
 	assert(pp0->refn == 1);
-	pp0->refn = 0;
-
-	// free the regions we took
-	region_free(pp0);
+	pgdir_free_table(kern_pgdir, 0x0);
+	assert(pp0->refn == 0);
+	return_free_regions();
 
 	cprintf("check_page_installed_pgdir() succeeded!\n");
 }
-
-void tlb_invalidate(pde_t* pgdir, uintptr_t va) {
-    asm("mcr p15, 0, %0, c8,c7, 1"
-        :
-        : "r"(va)
-        :);
-}
-
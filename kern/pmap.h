@@ -2,18 +2,97 @@
 #include <inc/types.h>
 #include <inc/memlayout.h>
 
+#define PADDR(kva) ((uintptr_t)(kva) - KERNBASE)
+#define KADDR(pa) ((uintptr_t)(pa) + KERNBASE)
+// Most physical memory the kernel can direct-map at KERNBASE.
+#define DIRECTMAP_MAX ((physaddr_t)0 - KERNBASE)
+
+#define MEM_UNIT (16 * 1024)
+// Largest buddy block is MEM_UNIT << REGION_MAX_ORDER (16MiB).
+#define REGION_MAX_ORDER 10
+
 #define ALLOC_ZERO 1
-void mem_init();
+void mem_init(physaddr_t bootparams);
 uintptr_t mmio_map_region(physaddr_t pa, size_t size);
+uintptr_t mmio_map_attr(physaddr_t pa, size_t size, int memtype);
+int mmio_unmap_region(uintptr_t va);
 
 struct mem_region
 {
 	struct mem_region *next;
+	union {
+		struct mem_region *prev;
+		uint32_t asid;	// ASID and its generation (REGION_PGDIR)
+	};
 	int refn;
+	uint8_t order;	// order of the free block this region heads
+	uint8_t flags;
+	uint16_t l2_used;	// page table slots in use (REGION_L2)
 };
 
+// mem_region flags
+#define REGION_FREE 0x1	// heads a free block on free_area[order]
+#define REGION_SLAB 0x2	// holds a slab of kmem_cache objects
+#define REGION_KMALLOC 0x4	// heads a large kmalloc block of 'order'
+#define REGION_L2 0x8	// holds up to L2_PER_REGION page tables
+#define REGION_PGDIR 0x10	// holds a first-level page table
+
+// Second-level page tables are 1KiB, so several share one region.
+#define L2_SIZE (NPTENTRIES * sizeof(pte_t))
+#define L2_PER_REGION (MEM_UNIT / L2_SIZE)
+
+extern pde_t kern_pgdir[];
+extern const physaddr_t boot_directmap_size;
+extern struct mem_region *regions;
+extern size_t nregions;
+
+static inline struct mem_region *pa2region(physaddr_t pa)
+{
+	return &regions[pa / MEM_UNIT];
+}
+
+static inline physaddr_t region2pa(struct mem_region *r)
+{
+	return MEM_UNIT * (r - regions);
+}
+
+static inline uintptr_t region2kva(struct mem_region *r)
+{
+	return KADDR(region2pa(r));
+}
+
+struct mem_region *region_alloc(int alloc_flags);
+struct mem_region *region_alloc_order(int order, int alloc_flags);
+void region_free(struct mem_region *r);
+void region_free_order(struct mem_region *r, int order);
+struct mem_region *region_alloc_range(size_t n, int alloc_flags);
+void region_free_range(struct mem_region *r, size_t n);
+void region_decref(struct mem_region *r);
+int nfree_regions(void);
+void region_free_runs(uint32_t hist[], int nbuckets, size_t *largest);
+void region_zero_idle(void);
+void zpool_print_stats(void);
+
+// perm flag of the range functions asking for strongly-ordered memory.
+// PTE_MEM_SO is 0, the same as not naming a type, which means
+// write-back.
+#define PERM_MEM_SO (1 << 30)
+
+int region_insert_range(pde_t *pgdir, struct mem_region *rg, uintptr_t va,
+			size_t size, int perm);
+int region_remove_range(pde_t *pgdir, uintptr_t va, size_t size);
+int region_populate_range(pde_t *pgdir, uintptr_t va, size_t size, int perm);
 int region_insert(pde_t *pgdir, struct mem_region *rg, uintptr_t va, int perm);
 void region_remove(pde_t *pgdir, uintptr_t va);
-struct mem_region* 
+struct mem_region*
 region_lookup(pde_t *pgdir, uintptr_t va, pte_t **pte_store);
+pde_t *pgdir_create(void);
+void pgdir_destroy(pde_t *pgdir);
+pde_t *pgdir_clone(pde_t *src);
+int region_cow_fault(pde_t *pgdir, uintptr_t va);
+int region_reserve(pde_t *pgdir, uintptr_t va, size_t size, int perm);
+int region_unreserve(pde_t *pgdir, uintptr_t va, size_t size);
+int region_anon_fault(pde_t *pgdir, uintptr_t va);
 void tlb_invalidate(pde_t* pgdir, uintptr_t va);
+struct tlb_gather;
+void region_gather_release(struct tlb_gather *tlb);
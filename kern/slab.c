@@ -0,0 +1,396 @@
+// Slab allocator for small kernel objects, layered on mem_regions.
+//
+// Every slab is a single MEM_UNIT region: a struct slab header followed
+// by equally sized objects. Free objects are chained through a pointer
+// stored in the object itself; caches with a constructor keep it just
+// past the object instead, so constructed state survives a free.
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <kern/pmap.h>
+#include <kern/slab.h>
+
+struct kmem_cache {
+	const char *name;
+	size_t objsize;		// size asked for
+	size_t size;		// distance between objects
+	size_t align;
+	size_t freeptr;		// offset of the free pointer in an object
+	size_t first;		// offset of the first object in a slab
+	int nobjs;		// objects per slab
+	void (*ctor)(void *);
+
+	struct slab *partial;	// slabs with both free and used objects
+	struct slab *full;
+	struct slab *empty;	// at most one unused slab is kept around
+
+	int nslabs;
+	int nactive;		// objects handed out
+	uint32_t nallocs, nfrees;
+	struct kmem_cache *next;
+};
+
+struct slab {
+	struct kmem_cache *cache;
+	struct slab *next, *prev;
+	void *freelist;
+	int inuse;
+};
+
+// kmalloc size classes: 16 bytes up to 4KiB. Anything bigger gets
+// whole buddy blocks.
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 12
+#define KMALLOC_NCLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+static struct kmem_cache cache_cache;	// holds the other kmem_caches
+static struct kmem_cache kmalloc_caches[KMALLOC_NCLASSES];
+static const char * const kmalloc_names[KMALLOC_NCLASSES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+	"kmalloc-4096",
+};
+static struct kmem_cache *caches;	// every cache, for slabinfo
+
+static void check_slab(void);
+
+static inline struct slab *obj2slab(const void *obj)
+{
+	return (struct slab *)ROUNDDOWN((uintptr_t)obj, MEM_UNIT);
+}
+
+static inline void **freeptr(struct kmem_cache *c, void *obj)
+{
+	return (void **)((char *)obj + c->freeptr);
+}
+
+static void slab_list_push(struct slab **head, struct slab *s)
+{
+	s->prev = NULL;
+	s->next = *head;
+	if (*head)
+		(*head)->prev = s;
+	*head = s;
+}
+
+static void slab_list_remove(struct slab **head, struct slab *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		*head = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	s->next = s->prev = NULL;
+}
+
+static void cache_setup(struct kmem_cache *c, const char *name,
+			size_t size, size_t align, void (*ctor)(void *))
+{
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	assert((align & (align - 1)) == 0);
+
+	memset(c, 0, sizeof(*c));
+	c->name = name;
+	c->objsize = size;
+	c->align = align;
+	c->ctor = ctor;
+	if (ctor) {
+		c->freeptr = ROUNDUP(size, sizeof(void *));
+		size = c->freeptr + sizeof(void *);
+	} else {
+		c->freeptr = 0;
+		size = MAX(size, sizeof(void *));
+	}
+	c->size = ROUNDUP(size, align);
+	c->first = ROUNDUP(sizeof(struct slab), align);
+	c->nobjs = (MEM_UNIT - c->first) / c->size;
+	assert(c->nobjs > 0);
+
+	c->next = caches;
+	caches = c;
+}
+
+static struct slab *slab_grow(struct kmem_cache *c)
+{
+	struct mem_region *rg;
+	struct slab *s;
+	char *obj;
+	int i;
+
+	if ((rg = region_alloc(0)) == NULL)
+		return NULL;
+	rg->refn++;
+	rg->flags |= REGION_SLAB;
+
+	s = (struct slab *)region2kva(rg);
+	s->cache = c;
+	s->inuse = 0;
+	s->freelist = NULL;
+	// chain the objects so they come out in address order
+	obj = (char *)s + c->first + (c->nobjs - 1) * c->size;
+	for (i = 0; i < c->nobjs; i++, obj -= c->size) {
+		if (c->ctor)
+			c->ctor(obj);
+		*freeptr(c, obj) = s->freelist;
+		s->freelist = obj;
+	}
+	c->nslabs++;
+	return s;
+}
+
+static void slab_release(struct kmem_cache *c, struct slab *s)
+{
+	struct mem_region *rg = pa2region(PADDR(s));
+
+	rg->flags &= ~REGION_SLAB;
+	c->nslabs--;
+	region_decref(rg);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c)
+{
+	struct slab *s;
+	void *obj;
+
+	if ((s = c->partial) == NULL) {
+		if ((s = c->empty) != NULL)
+			c->empty = NULL;
+		else if ((s = slab_grow(c)) == NULL)
+			return NULL;
+		slab_list_push(&c->partial, s);
+	}
+
+	obj = s->freelist;
+	s->freelist = *freeptr(c, obj);
+	if (++s->inuse == c->nobjs) {
+		slab_list_remove(&c->partial, s);
+		slab_list_push(&c->full, s);
+	}
+	c->nactive++;
+	c->nallocs++;
+	return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+	struct slab *s = obj2slab(obj);
+
+	assert(s->cache == c);
+	assert(((char *)obj - (char *)s - c->first) % c->size == 0);
+
+	if (s->inuse-- == c->nobjs) {
+		slab_list_remove(&c->full, s);
+		slab_list_push(&c->partial, s);
+	}
+	*freeptr(c, obj) = s->freelist;
+	s->freelist = obj;
+	c->nactive--;
+	c->nfrees++;
+
+	if (s->inuse == 0) {
+		slab_list_remove(&c->partial, s);
+		if (c->empty == NULL)
+			c->empty = s;
+		else
+			slab_release(c, s);
+	}
+}
+
+// Create a cache of objects of 'size' bytes. 'align' is the required
+// alignment (0 for word alignment, KMEM_CACHELINE_ALIGN to keep objects
+// from sharing cache lines); 'ctor', if not NULL, is run once on every
+// object when its slab is created and freed objects must be returned
+// to the constructed state.
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *))
+{
+	struct kmem_cache *c;
+
+	if ((c = kmem_cache_alloc(&cache_cache)) == NULL)
+		return NULL;
+	cache_setup(c, name, size, align, ctor);
+	return c;
+}
+
+// Give back the unused slab c keeps around.
+static void cache_shrink(struct kmem_cache *c)
+{
+	if (c->empty) {
+		slab_release(c, c->empty);
+		c->empty = NULL;
+	}
+}
+
+// Free a cache and its memory. Every object must have been freed.
+void kmem_cache_destroy(struct kmem_cache *c)
+{
+	struct kmem_cache **pc;
+
+	assert(c->nactive == 0 && !c->partial && !c->full);
+	cache_shrink(c);
+	for (pc = &caches; *pc != c; pc = &(*pc)->next)
+		assert(*pc);
+	*pc = c->next;
+	kmem_cache_free(&cache_cache, c);
+}
+
+void *kmalloc(size_t size)
+{
+	struct mem_region *rg;
+	int shift, order;
+
+	if (size == 0)
+		return NULL;
+	if (size <= (1 << KMALLOC_MAX_SHIFT)) {
+		for (shift = KMALLOC_MIN_SHIFT; (1 << shift) < size; shift++)
+			/* do nothing */;
+		return kmem_cache_alloc(&kmalloc_caches[shift - KMALLOC_MIN_SHIFT]);
+	}
+
+	for (order = 0; (MEM_UNIT << order) < size; order++)
+		if (order == REGION_MAX_ORDER)
+			return NULL;
+	if ((rg = region_alloc_order(order, 0)) == NULL)
+		return NULL;
+	rg->refn++;
+	rg->order = order;
+	rg->flags |= REGION_KMALLOC;
+	return (void *)region2kva(rg);
+}
+
+void kfree(void *ptr)
+{
+	struct mem_region *rg;
+
+	if (ptr == NULL)
+		return;
+	rg = pa2region(PADDR(ptr));
+	if (rg->flags & REGION_KMALLOC) {
+		assert(region2kva(rg) == (uintptr_t)ptr);
+		rg->flags &= ~REGION_KMALLOC;
+		rg->refn--;
+		region_free_order(rg, rg->order);
+		return;
+	}
+	assert(rg->flags & REGION_SLAB);
+	kmem_cache_free(obj2slab(ptr)->cache, ptr);
+}
+
+void slab_init(void)
+{
+	int i;
+
+	cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache),
+		    KMEM_CACHELINE_ALIGN, NULL);
+	for (i = 0; i < KMALLOC_NCLASSES; i++) {
+		size_t size = 1 << (i + KMALLOC_MIN_SHIFT);
+		cache_setup(&kmalloc_caches[i], kmalloc_names[i], size,
+			    MIN(size, (size_t)KMEM_CACHELINE_ALIGN), NULL);
+	}
+	check_slab();
+}
+
+void slab_print_info(void)
+{
+	struct kmem_cache *c;
+
+	cprintf("%-16s %6s %6s %6s %5s %6s %4s\n", "cache", "objsz",
+		"active", "total", "slabs", "per", "util");
+	for (c = caches; c; c = c->next) {
+		int total = c->nslabs * c->nobjs;
+		cprintf("%-16s %6d %6d %6d %5d %6d %3d%%\n", c->name,
+			c->objsize, c->nactive, total, c->nslabs, c->nobjs,
+			total ? c->nactive * 100 / total : 0);
+	}
+}
+
+struct check_obj {
+	uint32_t magic;
+	char payload[40];
+};
+
+#define CHECK_MAGIC 0x51ab51ab
+
+static void check_obj_ctor(void *obj)
+{
+	((struct check_obj *)obj)->magic = CHECK_MAGIC;
+}
+
+static void
+check_slab(void)
+{
+	static void *objs[1024];
+	struct kmem_cache *c;
+	struct check_obj *o;
+	int i, j, n, sz, nfree;
+	void *p;
+
+	nfree = nfree_regions();
+
+	// a cache-line aligned cache with a constructor
+	assert((c = kmem_cache_create("check_obj", sizeof(struct check_obj),
+				      KMEM_CACHELINE_ALIGN, check_obj_ctor)));
+	n = c->nobjs * 3 + 1;
+	assert(n <= 1024);
+	for (i = 0; i < n; i++) {
+		assert((o = objs[i] = kmem_cache_alloc(c)));
+		assert((uintptr_t)o % CACHELINE == 0);
+		assert(o->magic == CHECK_MAGIC);
+		memset(o->payload, i, sizeof(o->payload));
+	}
+	assert(c->nslabs == 4 && c->nactive == n);
+	for (i = 0; i < n; i++)
+		for (j = 0; j < sizeof(o->payload); j++)
+			assert(((struct check_obj *)objs[i])->payload[j] == (char)i);
+
+	// freed objects keep their constructed state and get reused
+	for (i = 0; i < n; i += 2)
+		kmem_cache_free(c, objs[i]);
+	for (i = 0; i < n; i += 2) {
+		assert((o = objs[i] = kmem_cache_alloc(c)));
+		assert(o->magic == CHECK_MAGIC);
+	}
+	assert(c->nslabs == 4);
+	for (i = 0; i < n; i++)
+		kmem_cache_free(c, objs[i]);
+	assert(c->nactive == 0);
+	// only one empty slab is kept
+	assert(c->nslabs == 1);
+	kmem_cache_destroy(c);
+	for (c = caches; c; c = c->next)
+		assert(strcmp(c->name, "check_obj") != 0);
+
+	// kmalloc hands out naturally aligned objects of every class
+	for (i = 1; i <= (1 << KMALLOC_MAX_SHIFT); i = i * 3 + 1) {
+		for (sz = 16; sz < i; sz <<= 1)
+			/* do nothing */;
+		assert((p = kmalloc(i)));
+		assert((uintptr_t)p % MIN(sz, CACHELINE) == 0);
+		memset(p, 0xa5, i);
+		objs[0] = p;
+		kfree(p);
+		assert(kmalloc(i) == objs[0]);
+		kfree(objs[0]);
+	}
+
+	// large allocations come straight from the buddy allocator
+	assert((p = kmalloc(MEM_UNIT * 3)));
+	assert((uintptr_t)p % (MEM_UNIT * 4) == 0);
+	assert(pa2region(PADDR(p))->flags & REGION_KMALLOC);
+	memset(p, 0, MEM_UNIT * 3);
+	kfree(p);
+	assert(!(pa2region(PADDR(p))->flags & REGION_KMALLOC));
+	assert(kmalloc(0) == NULL);
+
+	// nothing is left behind once the unused slabs are given back
+	for (c = caches; c; c = c->next)
+		cache_shrink(c);
+	assert(nfree_regions() == nfree);
+
+	cprintf("check_slab() succeeded!\n");
+}
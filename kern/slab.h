@@ -0,0 +1,20 @@
+#pragma once
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+struct kmem_cache;
+
+// Align objects to a cache line.
+#define KMEM_CACHELINE_ALIGN CACHELINE
+
+void slab_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *cache);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+
+void slab_print_info(void);
@@ -0,0 +1,346 @@
+// TLB maintenance. Page table changes made in a batch are collected in
+// a struct tlb_gather and flushed once at the end: entry by entry while
+// there are few of them, with one full invalidate past tlb_threshold.
+//
+// Address spaces other than kern_pgdir are tagged with an ASID, so
+// switching between them needs no flush. ASIDs are handed out in
+// generations: when they run out, the whole TLB is flushed once and
+// every address space takes a fresh ASID the next time it runs.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/arm.h>
+#include <inc/string.h>
+#include <kern/pmap.h>
+#include <kern/tlb.h>
+#include <kern/trace.h>
+
+// Past this many entries a full invalidate is cheaper than the
+// per-entry operations plus refilling what they would have spared.
+// Cortex-A8 has 32-entry instruction and data TLBs.
+int tlb_threshold = 32;
+
+static struct {
+	uint32_t batches;
+	uint32_t entries;	// invalidated one by one
+	uint32_t asids;		// whole ASIDs invalidated
+	uint32_t full;		// full invalidates
+	uint32_t switches;
+	uint32_t rollovers;	// ASID generations used up
+} tlbstat;
+
+// The generation counts up in the bits above the ASID.
+static uint32_t asid_generation = NASID;
+static uint32_t asid_next = ASID_FIRST;
+static bool asid_rollover;	// the TLB still holds the last generation
+static pde_t *curpgdir = kern_pgdir;
+
+static void check_tlb_gather(void);
+static void check_asid(void);
+
+void tlb_init(void)
+{
+	check_tlb_gather();
+	check_asid();
+}
+
+// The ASID the non-global TLB entries of pgdir are tagged with, or -1
+// if none of them can be in the TLB: its ASID is from a generation
+// that has been flushed.
+static int pgdir_tlb_asid(pde_t *pgdir)
+{
+	uint32_t asid;
+
+	if (pgdir == NULL || pgdir == kern_pgdir)
+		return ASID_KERN;
+	asid = pa2region(PADDR(pgdir))->asid;
+	if ((asid & ~(NASID - 1)) != asid_generation)
+		return -1;
+	return asid & (NASID - 1);
+}
+
+// Give pgdir a live ASID, starting a new generation if they have run
+// out. The TLB is flushed of the old one by pgdir_switch.
+static uint32_t pgdir_asid(pde_t *pgdir)
+{
+	struct mem_region *rg;
+	int asid;
+
+	if ((asid = pgdir_tlb_asid(pgdir)) >= 0)
+		return asid;
+	if (asid_next == NASID) {
+		asid_generation += NASID;
+		asid_next = ASID_FIRST;
+		asid_rollover = true;
+		tlbstat.rollovers++;
+	}
+	rg = pa2region(PADDR(pgdir));
+	rg->asid = asid_generation | asid_next++;
+	return rg->asid & (NASID - 1);
+}
+
+// Load pgdir into TTBR0 with its ASID. The ASID and TTBR0 can't be
+// changed together, so the reserved ASID 0 covers the window between
+// the two writes (ARM ARM B3.10.4): nothing walked from either table
+// then gets tagged with the other's ASID.
+void pgdir_switch(pde_t *pgdir)
+{
+	uint32_t asid = pgdir_asid(pgdir);
+
+	wcontextidr(0);
+	isb();
+	wttbr0(PADDR(pgdir) | TTBR_WALK);
+	isb();
+	// A new generation hands out the old ASID numbers again. Flushed
+	// any earlier, a walk of the outgoing table could still refill
+	// the TLB with entries tagged with its old ASID. Here, on ASID 0
+	// with the new table loaded, nothing can.
+	if (asid_rollover) {
+		tlb_flush_all();
+		asid_rollover = false;
+	}
+	wcontextidr(asid);
+	isb();
+	curpgdir = pgdir;
+	tlbstat.switches++;
+}
+
+// The address space in TTBR0.
+pde_t *pgdir_current(void)
+{
+	return curpgdir;
+}
+
+// Invalidate the TLB entry for va in pgdir right away, after a page
+// table change that can't wait for a gather (break-before-make).
+void tlb_invalidate(pde_t *pgdir, uintptr_t va)
+{
+	int asid = pgdir_tlb_asid(pgdir);
+
+	TRACE(TR_TLBINV, va, asid);
+	if (asid < 0 && va < ULIM)
+		return;
+	dsb();			// the table write is visible to the walker
+	tlbimva(ROUNDDOWN(va, PGSIZE) | MAX(asid, 0));
+	dsb();			// the invalidate has completed
+	isb();			// and the following instructions see it
+}
+
+void tlb_flush_all(void)
+{
+	dsb();
+	tlbiall();
+	dsb();
+	isb();
+}
+
+void tlb_gather_init(struct tlb_gather *tlb, pde_t *pgdir)
+{
+	tlb->pgdir = pgdir;
+	tlb->full = false;
+	tlb->global = pgdir == kern_pgdir;
+	tlb->n = 0;
+	tlb->ntables = 0;
+	tlb->nruns = 0;
+}
+
+// Note that the mapping covering va has changed. One address per
+// mapping is enough, whatever its size.
+void tlb_gather_add(struct tlb_gather *tlb, uintptr_t va)
+{
+	if (va >= ULIM)
+		tlb->global = true;
+	if (tlb->full)
+		return;
+	if (tlb->n >= MIN(tlb_threshold, TLB_GATHER_MAX)) {
+		tlb->full = true;
+		return;
+	}
+	tlb->va[tlb->n++] = va;
+}
+
+void tlb_gather_flush(struct tlb_gather *tlb)
+{
+	int asid = pgdir_tlb_asid(tlb->pgdir);
+	int i;
+
+	if (!tlb->full && tlb->n == 0)
+		goto release;
+	dsb();
+	if (asid < 0 && !tlb->global) {
+		// nothing of this address space is in the TLB
+	} else if (tlb->full && !tlb->global) {
+		tlbiasid(asid);
+		tlbstat.asids++;
+	} else if (tlb->full) {
+		tlbiall();
+		tlbstat.full++;
+	} else {
+		for (i = 0; i < tlb->n; i++)
+			if (asid >= 0 || tlb->va[i] >= ULIM)
+				tlbimva(ROUNDDOWN(tlb->va[i], PGSIZE) | MAX(asid, 0));
+		tlbstat.entries += tlb->n;
+	}
+	dsb();
+	isb();
+	tlbstat.batches++;
+	tlb->full = false;
+	tlb->global = tlb->pgdir == kern_pgdir;
+	tlb->n = 0;
+release:
+	// nothing in the TLB leads to them any more
+	region_gather_release(tlb);
+}
+
+void tlb_print_stats(void)
+{
+	cprintf("threshold %d (max %d)\n", tlb_threshold, TLB_GATHER_MAX);
+	cprintf("batches %u  entries invalidated %u  ASID flushes %u  "
+		"full flushes %u\n", tlbstat.batches, tlbstat.entries,
+		tlbstat.asids, tlbstat.full);
+	cprintf("switches %u  ASID generation %u (%u rollovers)\n",
+		tlbstat.switches, asid_generation >> ASID_BITS,
+		tlbstat.rollovers);
+}
+
+// Switch between two address spaces that touch a few pages each,
+// once relying on ASIDs and once flushing the TLB on every switch as
+// a kernel without them would.
+#define BENCH_VA 0x10000000
+#define BENCH_PAGES 16
+
+void asid_bench(int iters)
+{
+	pde_t *pgdir[2] = { NULL, NULL };
+	struct mem_region *rg;
+	uint32_t start, sum = 0;
+	int i, j, n, flush;
+
+	for (i = 0; i < 2; i++) {
+		if ((pgdir[i] = pgdir_create()) == NULL)
+			goto out;
+		for (j = 0; j < BENCH_PAGES; j++)
+			if ((rg = region_alloc(ALLOC_ZERO)) == NULL ||
+			    region_insert_range(pgdir[i], rg, BENCH_VA + j * PGSIZE,
+						PGSIZE, PTE_RW_U) < 0) {
+				if (rg && rg->refn == 0)
+					region_free(rg);
+				goto out;
+			}
+	}
+
+	for (flush = 0; flush < 2; flush++) {
+		start = rpmccntr();
+		for (n = 0; n < iters; n++) {
+			pgdir_switch(pgdir[n & 1]);
+			if (flush)
+				tlb_flush_all();
+			for (j = 0; j < BENCH_PAGES; j++)
+				sum += *(volatile uint32_t *)(BENCH_VA + j * PGSIZE);
+		}
+		cprintf("%s: %u cycles per switch and %d page touches\n",
+			flush ? "flush" : "asid ", (rpmccntr() - start) / iters,
+			BENCH_PAGES);
+	}
+	assert(sum == 0);
+
+out:
+	pgdir_switch(kern_pgdir);
+	for (i = 0; i < 2; i++)
+		if (pgdir[i])
+			pgdir_destroy(pgdir[i]);
+	if (!pgdir[0] || !pgdir[1])
+		cprintf("asidbench: out of memory\n");
+}
+
+static void
+check_tlb_gather(void)
+{
+	struct tlb_gather tlb;
+	int saved = tlb_threshold;
+	int i;
+
+	tlb_threshold = 4;
+	tlb_gather_init(&tlb, NULL);
+	tlb_gather_flush(&tlb);
+	assert(tlb.n == 0 && !tlb.full);
+	for (i = 0; i < 4; i++)
+		tlb_gather_add(&tlb, i * PGSIZE);
+	assert(tlb.n == 4 && !tlb.full);
+	tlb_gather_add(&tlb, 4 * PGSIZE);
+	assert(tlb.full);
+	tlb_gather_flush(&tlb);
+	assert(tlb.n == 0 && !tlb.full);
+
+	// the threshold can't exceed what a gather holds
+	tlb_threshold = TLB_GATHER_MAX * 2;
+	for (i = 0; i < TLB_GATHER_MAX; i++)
+		tlb_gather_add(&tlb, i * PGSIZE);
+	assert(!tlb.full);
+	tlb_gather_add(&tlb, 0);
+	assert(tlb.full);
+	tlb_gather_flush(&tlb);
+
+	tlb_threshold = saved;
+	cprintf("check_tlb_gather() succeeded!\n");
+}
+
+static void
+check_asid(void)
+{
+	pde_t *pgdir0, *pgdir1, *pgdir2;
+	uint32_t gen = asid_generation, rollovers = tlbstat.rollovers;
+	struct mem_region *pp;
+	pte_t *pte;
+	int a0, a1;
+
+	assert((pgdir0 = pgdir_create()) && (pgdir1 = pgdir_create()));
+	// the kernel half is shared, the user half is empty
+	assert(memcmp(&pgdir0[PDX(ULIM)], &kern_pgdir[PDX(ULIM)],
+		      (NPDENTRIES - PDX(ULIM)) * sizeof(pde_t)) == 0);
+	assert(pgdir0[0] == 0 && pgdir0[PDX(ULIM) - 1] == 0);
+
+	// an ASID is handed out the first time an address space runs
+	assert(pgdir_tlb_asid(pgdir0) < 0);
+	pgdir_switch(pgdir0);
+	assert(curpgdir == pgdir0);
+	assert((a0 = pgdir_tlb_asid(pgdir0)) >= ASID_FIRST);
+	pgdir_switch(pgdir1);
+	assert((a1 = pgdir_tlb_asid(pgdir1)) >= ASID_FIRST && a1 != a0);
+	pgdir_switch(pgdir0);
+	assert(pgdir_tlb_asid(pgdir0) == a0);
+	// the kernel never runs on ASID 0, which pgdir_switch passes through
+	pgdir_switch(kern_pgdir);
+	assert(pgdir_tlb_asid(kern_pgdir) == ASID_KERN);
+
+	// user mappings are tagged with the ASID
+	assert((pp = region_alloc(0)));
+	assert(region_insert_range(pgdir0, pp, BENCH_VA, PGSIZE, PTE_RW_U) == 0);
+	assert(region_lookup(pgdir0, BENCH_VA, &pte) == pp && (*pte & PTE_NG));
+	assert(pp->refn == 1);
+
+	// running out starts a new generation; old ASIDs are dead
+	asid_next = NASID;
+	assert((pgdir2 = pgdir_create()));
+	pgdir_switch(pgdir2);
+	assert(asid_generation == gen + NASID && !asid_rollover);
+	assert(pgdir_tlb_asid(pgdir2) == ASID_FIRST);
+	assert(pgdir_tlb_asid(pgdir0) < 0 && pgdir_tlb_asid(pgdir1) < 0);
+	assert(pgdir_tlb_asid(kern_pgdir) == ASID_KERN);
+	pgdir_switch(pgdir0);
+	assert(pgdir_tlb_asid(pgdir0) == ASID_FIRST + 1);
+	pgdir_switch(kern_pgdir);
+	pgdir_destroy(pgdir2);
+
+	// destroying an address space releases what it mapped
+	pgdir_destroy(pgdir0);
+	assert(pp->refn == 0);
+	pgdir_destroy(pgdir1);
+
+	// the generation only moves forward: the ASIDs of the old one may
+	// still be in the TLB of a later one otherwise. Only the statistics
+	// go back.
+	tlbstat.rollovers = rollovers;
+	cprintf("check_asid() succeeded!\n");
+}
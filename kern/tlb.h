@@ -0,0 +1,48 @@
+#pragma once
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// Most entries a gather invalidates one by one; tlb_threshold is
+// capped to this.
+#define TLB_GATHER_MAX 64
+
+// Page tables and runs of memory a gather holds on to.
+#define TLB_GATHER_FREE 16
+
+// Pending TLB invalidations for a batch of page table changes. Page
+// tables and memory unmapped by the batch are only released once the
+// TLB can no longer reach them, after the invalidations.
+struct tlb_gather {
+	pde_t *pgdir;
+	bool full;		// past the threshold: flush the ASID or all
+	bool global;		// kernel (global) mappings changed
+	int n;
+	uintptr_t va[TLB_GATHER_MAX];
+	int ntables;
+	pte_t *tables[TLB_GATHER_FREE];	// unhooked page tables
+	int nruns;
+	struct {
+		physaddr_t pa;
+		size_t size;
+	} runs[TLB_GATHER_FREE];	// memory whose references go
+};
+
+extern int tlb_threshold;
+
+void tlb_init(void);
+void tlb_gather_init(struct tlb_gather *tlb, pde_t *pgdir);
+void tlb_gather_add(struct tlb_gather *tlb, uintptr_t va);
+void tlb_gather_flush(struct tlb_gather *tlb);
+void tlb_flush_all(void);
+void tlb_print_stats(void);
+
+// Hardware ASIDs are 8 bits. 0 is kept for the switch between two
+// address spaces and 1 for kern_pgdir, whose mappings are all global.
+#define ASID_BITS 8
+#define NASID (1 << ASID_BITS)
+#define ASID_KERN 1
+#define ASID_FIRST 2	// the first one other address spaces get
+
+void pgdir_switch(pde_t *pgdir);
+pde_t *pgdir_current(void);
+void asid_bench(int iters);
@@ -0,0 +1,187 @@
+// Static tracepoints. TRACE(ev, a0, a1) in the allocator, the page
+// table and TLB code and the console records a 16-byte binary event
+// (what, when in cycles, two arguments) in a preallocated ring while ev
+// is enabled in trace_mask. Nothing is formatted until the trace is
+// dumped, so tracing adds little to the paths it measures. The ring
+// keeps the latest TRACE_NRECS events.
+//
+// Tracepoints are compiled in when the kernel is built with TRACEPOINTS.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/arm.h>
+#include <kern/pmap.h>
+#include <kern/trace.h>
+
+static const char * const event_names[TR_NEVENTS] = {
+	"alloc", "free", "walk", "insert", "remove", "tlbinv",
+	"conswrite", "consirq",
+};
+
+// Turn event names into a mask; no names or "all" mean every event.
+int trace_parse(int argc, char **argv, uint32_t *mask)
+{
+	int i, ev;
+
+	*mask = argc ? 0 : (1u << TR_NEVENTS) - 1;
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "all") == 0) {
+			*mask = (1u << TR_NEVENTS) - 1;
+			continue;
+		}
+		for (ev = 0; ev < TR_NEVENTS; ev++)
+			if (strcmp(argv[i], event_names[ev]) == 0)
+				break;
+		if (ev == TR_NEVENTS) {
+			cprintf("unknown event '%s'; events:", argv[i]);
+			for (ev = 0; ev < TR_NEVENTS; ev++)
+				cprintf(" %s", event_names[ev]);
+			cprintf("\n");
+			return -1;
+		}
+		*mask |= 1u << ev;
+	}
+	return 0;
+}
+
+#ifdef TRACEPOINTS
+
+#define TRACE_NRECS 4096	// a power of two
+
+struct trace_rec {
+	uint32_t cycles;
+	uint16_t ev;
+	uint16_t pad;
+	uint32_t arg[2];
+};
+
+static struct trace_rec recs[TRACE_NRECS];
+static uint32_t head;		// events recorded since the last clear
+
+uint32_t trace_mask;
+
+static void check_trace(void);
+
+void trace_init(void)
+{
+	check_trace();
+}
+
+void trace_record(int ev, uint32_t a0, uint32_t a1)
+{
+	// interrupts may trace between our claim and our writes, but
+	// into a slot of their own
+	uint32_t seq = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+	struct trace_rec *r = &recs[seq % TRACE_NRECS];
+
+	r->cycles = rpmccntr();
+	r->ev = ev;
+	r->arg[0] = a0;
+	r->arg[1] = a1;
+}
+
+void trace_start(uint32_t mask)
+{
+	trace_mask = mask;
+}
+
+void trace_stop(void)
+{
+	trace_mask = 0;
+}
+
+void trace_clear(void)
+{
+	head = 0;
+}
+
+// Print the events in the ring that are in mask, oldest first, with
+// the cycles since the previous one printed.
+void trace_dump(uint32_t mask)
+{
+	uint32_t saved = trace_mask;
+	uint32_t seq, prev = 0;
+	struct trace_rec *r;
+	bool first = true;
+
+	// printing goes through the console tracepoints
+	trace_mask = 0;
+	cprintf("%10s %10s %-9s %8s %8s\n", "cycles", "delta", "event",
+		"arg0", "arg1");
+	for (seq = head > TRACE_NRECS ? head - TRACE_NRECS : 0;
+	     seq != head; seq++) {
+		r = &recs[seq % TRACE_NRECS];
+		if (!(mask & (1u << r->ev)))
+			continue;
+		cprintf("%10u %10u %-9s %08x %08x\n", r->cycles,
+			first ? 0 : r->cycles - prev, event_names[r->ev],
+			r->arg[0], r->arg[1]);
+		prev = r->cycles;
+		first = false;
+	}
+	cprintf("%u events recorded, %u overwritten; tracing %s\n", head,
+		head > TRACE_NRECS ? head - TRACE_NRECS : 0,
+		saved ? "on" : "off");
+	trace_mask = saved;
+}
+
+static void
+check_trace(void)
+{
+	struct mem_region *rg;
+	struct trace_rec *r;
+
+	// only enabled events are recorded, with their arguments
+	trace_clear();
+	trace_start(1u << TR_ALLOC);
+	assert((rg = region_alloc(0)) != NULL);
+	region_free(rg);
+	trace_stop();
+	assert(head == 1);
+	r = &recs[0];
+	assert(r->ev == TR_ALLOC && r->arg[0] == region2pa(rg) && r->arg[1] == 0);
+
+	trace_start(1u << TR_FREE);
+	assert((rg = region_alloc(0)) != NULL);
+	region_free(rg);
+	trace_stop();
+	assert(head == 2);
+	r = &recs[1];
+	assert(r->ev == TR_FREE && r->arg[0] == region2pa(rg));
+
+	// nothing when off
+	assert((rg = region_alloc(0)) != NULL);
+	region_free(rg);
+	assert(head == 2);
+
+	trace_clear();
+	cprintf("check_trace() succeeded!\n");
+}
+
+#else
+
+void trace_init(void)
+{
+}
+
+void trace_start(uint32_t mask)
+{
+	cprintf("tracepoints disabled (build with TRACEPOINTS)\n");
+}
+
+void trace_stop(void)
+{
+}
+
+void trace_clear(void)
+{
+}
+
+void trace_dump(uint32_t mask)
+{
+	cprintf("tracepoints disabled (build with TRACEPOINTS)\n");
+}
+
+#endif
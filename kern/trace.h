@@ -0,0 +1,39 @@
+#pragma once
+#include <inc/types.h>
+#include <inc/config.h>
+
+// Events with a tracepoint, one bit each in trace_mask.
+enum {
+	TR_ALLOC,	// region_alloc, region_alloc_order: pa, order
+	TR_FREE,	// region_free, region_free_order, region_decref: pa, order
+	TR_WALK,	// pgdir_walk: va, create
+	TR_INSERT,	// region_insert_range: va, size
+	TR_REMOVE,	// region_remove_range: va, size
+	TR_TLBINV,	// tlb_invalidate: va, asid
+	TR_CONSWRITE,	// console_write: length, bytes queued
+	TR_CONSIRQ,	// UART interrupt: bytes queued, bytes received
+	TR_NEVENTS
+};
+
+#ifdef TRACEPOINTS
+// Events being recorded; zero when tracing is off.
+extern uint32_t trace_mask;
+
+void trace_record(int ev, uint32_t a0, uint32_t a1);
+
+// Record ev with two arguments if it is enabled. Disabled, it costs a
+// load and a branch.
+#define TRACE(ev, a0, a1) do {						\
+	if (__builtin_expect(trace_mask & (1u << (ev)), 0))		\
+		trace_record(ev, (uint32_t)(a0), (uint32_t)(a1));	\
+} while (0)
+#else
+#define TRACE(ev, a0, a1) do { (void)sizeof(a0); (void)sizeof(a1); } while (0)
+#endif
+
+void trace_init(void);
+int trace_parse(int argc, char **argv, uint32_t *mask);
+void trace_start(uint32_t mask);
+void trace_stop(void);
+void trace_clear(void);
+void trace_dump(uint32_t mask);
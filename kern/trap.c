@@ -0,0 +1,224 @@
+// Exception handling. trapentry.S saves a Trapframe on the SVC stack for
+// every exception and calls trap(), which dispatches on its type. Aborts
+// on memory reserved with region_reserve or shared copy-on-write are
+// resolved and the faulting instruction is retried; anything else is
+// fatal.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/arm.h>
+#include <kern/pmap.h>
+#include <kern/tlb.h>
+#include <kern/trap.h>
+#include <kern/irq.h>
+
+extern char vectors[];
+
+static const char *const trapnames[NTRAPTYPES] = {
+	[T_RESET] = "reset",
+	[T_UNDEF] = "undefined instruction",
+	[T_SVC] = "supervisor call",
+	[T_PABT] = "prefetch abort",
+	[T_DABT] = "data abort",
+	[5] = "unused vector",
+	[T_IRQ] = "irq",
+	[T_FIQ] = "fiq",
+};
+
+// Per exception type: how many were taken and the cycles from the entry
+// stamp in alltraps to the end of the handler.
+static struct {
+	uint32_t count;
+	uint64_t cycles;
+	uint32_t max;
+} stats[NTRAPTYPES];
+
+static void check_trap(void);
+
+void trap_init(void)
+{
+	wvbar((uint32_t)vectors);
+	isb();
+	check_trap();
+}
+
+void print_trapframe(struct Trapframe *tf)
+{
+	int i;
+
+	cprintf("TRAP frame at %p: %s\n", tf, trapnames[tf->tf_trapno]);
+	for (i = 0; i < 13; i++)
+		cprintf("  r%-2d  0x%08x%s", i, tf->tf_r[i], i % 4 == 3 ? "\n" : "");
+	cprintf("\n  sp   0x%08x  lr   0x%08x  pc   0x%08x  spsr 0x%08x\n",
+		tf->tf_sp, tf->tf_lr, tf->tf_pc, tf->tf_spsr);
+}
+
+// Resolve a translation fault on reserved memory or a write to a page
+// shared copy-on-write; anything else is fatal.
+static void fault(struct Trapframe *tf, uintptr_t va, uint32_t fsr, bool write)
+{
+	pde_t *pgdir = va >= ULIM ? kern_pgdir : pgdir_current();
+
+	switch (FSR_FS(fsr)) {
+	case FS_TRANS_SECT:
+	case FS_TRANS_PAGE:
+		if (region_anon_fault(pgdir, va) == 0)
+			return;
+		break;
+	case FS_PERM_SECT:
+	case FS_PERM_PAGE:
+		if (write && region_cow_fault(pgdir, va) == 0)
+			return;
+		break;
+	}
+	print_trapframe(tf);
+	panic("unhandled %s: %s at va 0x%08x, fsr 0x%x",
+	      trapnames[tf->tf_trapno], write ? "write" : "read", va, fsr);
+}
+
+void trap(struct Trapframe *tf, uint32_t t0)
+{
+	uint32_t fsr, cycles;
+
+	switch (tf->tf_trapno) {
+	case T_SVC:
+		// no system calls yet: return at once, which is what
+		// trapbench times
+		break;
+	case T_DABT:
+		fsr = rdfsr();
+		fault(tf, rdfar(), fsr, fsr & FSR_WNR);
+		break;
+	case T_PABT:
+		fault(tf, rifar(), rifsr(), 0);
+		break;
+	case T_IRQ:
+		irq_dispatch();
+		break;
+	default:
+		print_trapframe(tf);
+		panic("unexpected %s", trapnames[tf->tf_trapno]);
+	}
+
+	cycles = rpmccntr() - t0;
+	stats[tf->tf_trapno].count++;
+	stats[tf->tf_trapno].cycles += cycles;
+	if (cycles > stats[tf->tf_trapno].max)
+		stats[tf->tf_trapno].max = cycles;
+}
+
+void trap_print_stats(void)
+{
+	int i;
+
+	cprintf("%-22s %9s %12s %7s %9s\n", "exception", "count", "cycles",
+		"avg", "max");
+	for (i = 0; i < NTRAPTYPES; i++)
+		if (stats[i].count)
+			cprintf("%-22s %9u %12llu %7u %9u\n", trapnames[i],
+				stats[i].count, stats[i].cycles,
+				(uint32_t)(stats[i].cycles / stats[i].count),
+				stats[i].max);
+}
+
+void trap_reset_stats(void)
+{
+	memset(stats, 0, sizeof(stats));
+}
+
+// A supervisor call that does nothing. lr is the SVC mode lr, which
+// taking the exception overwrites.
+static inline void null_svc(void)
+{
+	asm volatile("svc #0" : : : "lr", "memory");
+}
+
+// Time a null supervisor call round trip, and how much of it falls
+// outside trap(), in the entry and exit paths.
+void trap_bench(int iters)
+{
+	uint32_t start, total, count = stats[T_SVC].count;
+	uint64_t inside = stats[T_SVC].cycles;
+	int i;
+
+	start = rpmccntr();
+	for (i = 0; i < iters; i++)
+		null_svc();
+	total = rpmccntr() - start;
+	inside = stats[T_SVC].cycles - inside;
+	assert(stats[T_SVC].count - count == iters);
+
+	cprintf("svc: %u cycles round trip, %u from the entry stamp to the "
+		"end of trap()\n", total / iters, (uint32_t)(inside / iters));
+}
+
+// check that real faults reach the demand-zero and copy-on-write paths
+static void
+check_trap(void)
+{
+	volatile uint32_t *p;
+	uintptr_t va = 0x10000000;
+	pde_t *pgdir0, *pgdir1;
+	pte_t *pte;
+	uint32_t nsvc = stats[T_SVC].count;
+	int i;
+
+	// a supervisor call comes back with the registers it was made with
+	{
+		register uint32_t r0 asm("r0") = 0x10, r1 asm("r1") = 0x11;
+		register uint32_t r2 asm("r2") = 0x12, r3 asm("r3") = 0x13;
+		register uint32_t r12 asm("r12") = 0x1c;
+
+		asm volatile("svc #0" : "+r"(r0), "+r"(r1), "+r"(r2), "+r"(r3),
+			     "+r"(r12) : : "lr", "memory");
+		assert(r0 == 0x10 && r1 == 0x11 && r2 == 0x12 && r3 == 0x13 &&
+		       r12 == 0x1c);
+	}
+	assert(stats[T_SVC].count == nsvc + 1);
+
+	// a 64MiB reservation costs nothing until touched, and then only
+	// a region per region-sized piece touched
+	assert(region_reserve(kern_pgdir, va, 64 * PTSIZE, PTE_NONE_U) == 0);
+	assert(region_reserve(kern_pgdir, va + PTSIZE, PGSIZE, PTE_NONE_U) < 0);
+	assert(region_lookup(kern_pgdir, va, &pte) == NULL);
+	for (i = 0; i < 64; i += 9) {
+		p = (uint32_t *)(va + i * PTSIZE + 0x1230);
+		assert(*p == 0);
+		*p = i;
+	}
+	for (i = 0; i < 64; i += 9) {
+		p = (uint32_t *)(va + i * PTSIZE + 0x1230);
+		assert(*p == i);
+		// the rest of the region came with the page touched
+		assert(region_lookup(kern_pgdir, va + i * PTSIZE + 3 * PGSIZE, &pte)
+		       == region_lookup(kern_pgdir, (uintptr_t)p, &pte));
+		assert(region_lookup(kern_pgdir, va + i * PTSIZE + MEM_UNIT, &pte)
+		       == NULL);
+	}
+	assert(region_unreserve(kern_pgdir, va, 64 * PTSIZE) == 0);
+	assert(region_lookup(kern_pgdir, va + 0x1230, &pte) == NULL);
+
+	// a write to a page shared copy-on-write gets a private copy
+	assert((pgdir0 = pgdir_create()));
+	assert(region_populate_range(pgdir0, va, PGSIZE, PTE_RW_U) == 0);
+	*(uint32_t *)region2kva(region_lookup(pgdir0, va, &pte)) = 1;
+	assert((pgdir1 = pgdir_clone(pgdir0)));
+	pgdir_switch(pgdir1);
+	p = (uint32_t *)va;
+	assert(*p == 1);
+	*p = 2;
+	assert(*p == 2);
+	pgdir_switch(pgdir0);
+	assert(*p == 1);
+	*p = 3;
+	pgdir_switch(pgdir1);
+	assert(*p == 2);
+	pgdir_switch(kern_pgdir);
+	pgdir_destroy(pgdir0);
+	pgdir_destroy(pgdir1);
+
+	cprintf("check_trap() succeeded!\n");
+}
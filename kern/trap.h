@@ -1,5 +1,35 @@
 #pragma once
 
-struct Trapframe {};
+// Exception types, numbered by their slot in the vector table.
+#define T_RESET 0
+#define T_UNDEF 1		// undefined instruction
+#define T_SVC 2			// supervisor call
+#define T_PABT 3		// prefetch abort
+#define T_DABT 4		// data abort
+#define T_IRQ 6
+#define T_FIQ 7
+#define NTRAPTYPES 8
 
-static inline void print_trapframe(struct Trapframe *tf){}
\ No newline at end of file
+#ifndef __ASSEMBLER__
+#include <inc/types.h>
+
+// Registers saved on exception entry, lowest address first. Every
+// exception is handled in SVC mode on the SVC stack: srs pushes tf_pc
+// and tf_spsr there, trapentry.S pushes the rest.
+struct Trapframe {
+	uint32_t tf_trapno;
+	uint32_t tf_sp;		// SVC mode sp of the interrupted code
+	uint32_t tf_r[13];
+	uint32_t tf_lr;		// SVC mode lr of the interrupted code
+	uint32_t tf_pc;		// where to resume
+	uint32_t tf_spsr;	// CPSR of the interrupted code
+};
+
+void trap_init(void);
+void trap(struct Trapframe *tf, uint32_t t0);
+void print_trapframe(struct Trapframe *tf);
+void trap_print_stats(void);
+void trap_reset_stats(void);
+void trap_bench(int iters);
+
+#endif /* !__ASSEMBLER__ */
@@ -37,25 +37,158 @@ static const char * const error_string[MAXERROR] =
 	[E_NOT_SUPP]	= "operation not supported",
 };
 
+// Two-character strings for 0..99 and 0x00..0xff, so each division or
+// shift yields two digits.
+static const char dec_pairs[200] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+static const char hex_pairs[512] =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+static const char hex_digits[] = "0123456789abcdef";
+
+// 32-bit division by 100 and 10000 as a multiply by the reciprocal,
+// exact for every 32-bit n. ARMv7-A has no divide instruction, and
+// this doesn't rely on the optimizer to avoid a call.
+static inline uint32_t
+div100(uint32_t n)
+{
+	return ((uint64_t)n * 0x51eb851f) >> 37;
+}
+
+static inline uint32_t
+div10k(uint32_t n)
+{
+	return ((uint64_t)n * 0xd1b71759) >> 45;
+}
+
+// Format num in decimal, ending at end; return the first digit.
+static char *
+fmt_dec32(char *end, uint32_t num)
+{
+	uint32_t q;
+
+	while (num >= 100) {
+		q = div100(num);
+		end -= 2;
+		memcpy(end, &dec_pairs[2 * (num - q * 100)], 2);
+		num = q;
+	}
+	if (num >= 10) {
+		end -= 2;
+		memcpy(end, &dec_pairs[2 * num], 2);
+	} else
+		*--end = '0' + num;
+	return end;
+}
+
+// Divide *num by 10000 and return the remainder, 16 bits at a time so
+// every step is a 32-bit division rather than a call to the 64-bit
+// division in libgcc.
+static uint32_t
+div10000(uint64_t *num)
+{
+	uint32_t hi = *num >> 32, lo = *num, t, r;
+	uint32_t q3, q2, q1, q0;
+
+	q3 = div10k(hi >> 16);
+	r = (hi >> 16) - q3 * 10000;
+	t = (r << 16) | (hi & 0xffff);
+	q2 = div10k(t);
+	r = t - q2 * 10000;
+	t = (r << 16) | (lo >> 16);
+	q1 = div10k(t);
+	r = t - q1 * 10000;
+	t = (r << 16) | (lo & 0xffff);
+	q0 = div10k(t);
+	r = t - q0 * 10000;
+	*num = ((uint64_t)((q3 << 16) | q2) << 32) | (q1 << 16) | q0;
+	return r;
+}
+
+static char *
+fmt_dec(char *end, unsigned long long num)
+{
+	uint32_t r;
+
+	// four digits at a time until the rest fits in 32 bits
+	while (num >> 32) {
+		r = div10000(&num);
+		end -= 4;
+		memcpy(end, &dec_pairs[2 * div100(r)], 2);
+		memcpy(end + 2, &dec_pairs[2 * (r - div100(r) * 100)], 2);
+	}
+	return fmt_dec32(end, num);
+}
+
+// Base 16 is a shift and a mask per two digits.
+static char *
+fmt_hex(char *end, unsigned long long num)
+{
+	while (num >= 0x100) {
+		end -= 2;
+		memcpy(end, &hex_pairs[2 * (num & 0xff)], 2);
+		num >>= 8;
+	}
+	if (num >= 0x10) {
+		end -= 2;
+		memcpy(end, &hex_pairs[2 * num], 2);
+	} else
+		*--end = hex_digits[num];
+	return end;
+}
+
+// Base 8 is a shift and a mask per digit.
+static char *
+fmt_pow2(char *end, unsigned long long num, int shift)
+{
+	uint32_t mask = (1 << shift) - 1;
+
+	do {
+		*--end = hex_digits[num & mask];
+		num >>= shift;
+	} while (num);
+	return end;
+}
+
 /*
- * Print a number (base <= 16) in reverse order,
- * using specified putch function and associated pointer putdat.
+ * Print a number (base 8, 10 or 16) with its sign, padded to width
+ * with padc on the left, or with spaces on the right if padc is '-'.
+ * Zeros go between the sign and the digits.
  */
 static void
 printnum(void (*putch)(int, void*), void *putdat,
-	 unsigned long long num, unsigned base, int width, int padc)
+	 unsigned long long num, int neg, unsigned base, int width, int padc)
 {
-	// first recursively print all preceding (more significant) digits
-	if (num >= base) {
-		printnum(putch, putdat, (unsigned)num / base, base, width - 1, padc);
-	} else {
-		// print any needed pad characters before first digit
-		while (--width > 0)
-			putch(padc, putdat);
-	}
+	char buf[24];
+	char *end = buf + sizeof(buf), *p;
+	int len;
 
-	// then print this (the least significant) digit
-	putch("0123456789abcdef"[num % base], putdat);
+	if (base == 10)
+		p = fmt_dec(end, num);
+	else
+		p = base == 16 ? fmt_hex(end, num) : fmt_pow2(end, num, 3);
+	len = end - p + neg;
+
+	if (padc == ' ')
+		for (; width > len; width--)
+			putch(' ', putdat);
+	if (neg)
+		putch('-', putdat);
+	if (padc == '0')
+		for (; width > len; width--)
+			putch('0', putdat);
+	while (p < end)
+		putch(*p++, putdat);
+	for (; width > len; width--)
+		putch(' ', putdat);
 }
 
 // Get an unsigned int of various possible sizes from a varargs list,
@@ -94,7 +227,7 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 	register const char *p;
 	register int ch, err;
 	unsigned long long num;
-	int base, lflag, width, precision, altflag;
+	int base, lflag, width, precision, altflag, neg;
 	char padc;
 
 	while (1) {
@@ -199,12 +332,11 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 		// (signed) decimal
 		case 'd':
 			num = getint(&ap, lflag);
-			if ((long long) num < 0) {
-				putch('-', putdat);
-				num = -(long long) num;
-			}
+			neg = (long long) num < 0;
+			if (neg)
+				num = -num;
 			base = 10;
-			goto number;
+			goto signednumber;
 
 		// unsigned decimal
 		case 'u':
@@ -233,7 +365,9 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 			num = getuint(&ap, lflag);
 			base = 16;
 		number:
-			printnum(putch, putdat, num, base, width, padc);
+			neg = 0;
+		signednumber:
+			printnum(putch, putdat, num, neg, base, width, padc);
 			break;
 
 		// escaped '%' character